@@ -0,0 +1,273 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include "cache.h"
+
+//______hashing______
+
+#define P1 0x9E3779B185EBCA87ULL
+#define P2 0xC2B2AE3D27D4EB4FULL
+#define P3 0x165667B19E3779F9ULL
+#define P4 0x85EBCA77C2B2AE63ULL
+#define P5 0x27D4EB2F165667C5ULL
+
+static inline uint64_t rotl64(uint64_t x, int r) {
+  return (x << r) | (x >> (64 - r));
+}
+
+/* little-endian loads, so keys are the same on every host */
+static inline uint64_t read64(const unsigned char *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24
+         | (uint64_t)p[4] << 32 | (uint64_t)p[5] << 40 | (uint64_t)p[6] << 48 | (uint64_t)p[7] << 56;
+}
+
+static inline uint64_t read32(const unsigned char *p) {
+  return (uint64_t)p[0] | (uint64_t)p[1] << 8 | (uint64_t)p[2] << 16 | (uint64_t)p[3] << 24;
+}
+
+static inline uint64_t xxh_round(uint64_t acc, uint64_t input) {
+  acc += input * P2;
+  acc = rotl64(acc, 31);
+  return acc * P1;
+}
+
+static inline uint64_t xxh_merge(uint64_t acc, uint64_t val) {
+  acc ^= xxh_round(0, val);
+  return acc * P1 + P4;
+}
+
+unsigned long long hash64(const void *data, size_t len, unsigned long long seed) {
+  const unsigned char *p = data;
+  const unsigned char *end = p + len;
+  uint64_t h;
+
+  //four lanes over 32 byte stripes
+  if (len >= 32) {
+    uint64_t v1 = seed + P1 + P2;
+    uint64_t v2 = seed + P2;
+    uint64_t v3 = seed;
+    uint64_t v4 = seed - P1;
+    do {
+      v1 = xxh_round(v1, read64(p));
+      v2 = xxh_round(v2, read64(p + 8));
+      v3 = xxh_round(v3, read64(p + 16));
+      v4 = xxh_round(v4, read64(p + 24));
+      p += 32;
+    } while (end - p >= 32);
+
+    h = rotl64(v1, 1) + rotl64(v2, 7) + rotl64(v3, 12) + rotl64(v4, 18);
+    h = xxh_merge(h, v1);
+    h = xxh_merge(h, v2);
+    h = xxh_merge(h, v3);
+    h = xxh_merge(h, v4);
+  } else {
+    h = seed + P5;
+  }
+  h += len;
+
+  //the tail, 8, 4 and 1 bytes at a time
+  while (end - p >= 8) {
+    h ^= xxh_round(0, read64(p));
+    h = rotl64(h, 27) * P1 + P4;
+    p += 8;
+  }
+  if (end - p >= 4) {
+    h ^= read32(p) * P1;
+    h = rotl64(h, 23) * P2 + P3;
+    p += 4;
+  }
+  while (p < end) {
+    h ^= *p++ * P5;
+    h = rotl64(h, 11) * P1;
+  }
+
+  //final avalanche
+  h ^= h >> 33;
+  h *= P2;
+  h ^= h >> 29;
+  h *= P3;
+  h ^= h >> 32;
+  return h;
+}
+
+unsigned long long hash64_file(const char *path, unsigned long long seed) {
+  FILE *fp = fopen(path, "rb");
+  if (fp == NULL) {
+    return seed;
+  }
+  unsigned char buf[1 << 16];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), fp)) > 0) {
+    seed = hash64(buf, n, seed);
+  }
+  fclose(fp);
+  return seed;
+}
+
+//______cache directory______
+
+static void entry_path(char *path, size_t size, const char *dir, unsigned long long key) {
+  snprintf(path, size, "%s/%016llx.ppm", dir, key);
+}
+
+/* copies src to dest; returns 0 on success */
+static int copy_file(const char *src, const char *dest) {
+  FILE *in = fopen(src, "rb");
+  if (in == NULL) {
+    return -1;
+  }
+  FILE *out = fopen(dest, "wb");
+  if (out == NULL) {
+    fclose(in);
+    return -1;
+  }
+
+  unsigned char buf[1 << 16];
+  size_t n;
+  int rc = 0;
+  while ((n = fread(buf, 1, sizeof(buf), in)) > 0) {
+    if (fwrite(buf, 1, n, out) != n) {
+      rc = -1;
+      break;
+    }
+  }
+  if (ferror(in)) {
+    rc = -1;
+  }
+  fclose(in);
+  if (fclose(out) != 0) {
+    rc = -1;
+  }
+  return rc;
+}
+
+int cache_fetch(const char *dir, unsigned long long key, const char *dest) {
+  char path[4096];
+  entry_path(path, sizeof(path), dir, key);
+  if (copy_file(path, dest) != 0) {
+    return -1;
+  }
+  //a hit makes the entry the most recently used
+  utimensat(AT_FDCWD, path, NULL, 0);
+  return 0;
+}
+
+typedef struct {
+  char name[32];
+  off_t size;
+  struct timespec used;
+} CacheEntry;
+
+static int older_first(const void *a, const void *b) {
+  const CacheEntry *x = a, *y = b;
+  if (x->used.tv_sec != y->used.tv_sec) {
+    return x->used.tv_sec < y->used.tv_sec ? -1 : 1;
+  }
+  if (x->used.tv_nsec != y->used.tv_nsec) {
+    return x->used.tv_nsec < y->used.tv_nsec ? -1 : 1;
+  }
+  return 0;
+}
+
+/*
+removes least recently used entries until at most max_bytes remain;
+returns the number removed
+*/
+static int evict(const char *dir, long long max_bytes) {
+  DIR *d = opendir(dir);
+  if (d == NULL) {
+    return 0;
+  }
+
+  CacheEntry *entries = NULL;
+  size_t count = 0, cap = 0;
+  long long total = 0;
+  struct dirent *de;
+  char path[4096];
+  while ((de = readdir(d)) != NULL) {
+    size_t len = strlen(de->d_name);
+    if (len != 20 || strcmp(de->d_name + 16, ".ppm") != 0) {
+      continue;
+    }
+    struct stat st;
+    snprintf(path, sizeof(path), "%s/%s", dir, de->d_name);
+    if (stat(path, &st) != 0) {
+      continue;
+    }
+    if (count == cap) {
+      cap = cap ? cap * 2 : 64;
+      CacheEntry *grown = realloc(entries, sizeof(CacheEntry) * cap);
+      if (grown == NULL) {
+        break;
+      }
+      entries = grown;
+    }
+    memcpy(entries[count].name, de->d_name, len + 1);
+    entries[count].size = st.st_size;
+    entries[count].used = st.st_mtim;
+    total += st.st_size;
+    count++;
+  }
+  closedir(d);
+
+  int evicted = 0;
+  if (total > max_bytes) {
+    qsort(entries, count, sizeof(CacheEntry), older_first);
+    for (size_t i = 0; i < count && total > max_bytes; i++) {
+      snprintf(path, sizeof(path), "%s/%s", dir, entries[i].name);
+      if (unlink(path) == 0) {
+        total -= entries[i].size;
+        evicted++;
+      }
+    }
+  }
+  free(entries);
+  return evicted;
+}
+
+int cache_store(const char *dir, unsigned long long key, const char *src, long long max_bytes) {
+  mkdir(dir, 0777);
+
+  //write under a temporary name so readers never see a partial entry
+  char tmp[4096], path[4096];
+  snprintf(tmp, sizeof(tmp), "%s/%016llx.%ld.tmp", dir, key, (long)getpid());
+  entry_path(path, sizeof(path), dir, key);
+  if (copy_file(src, tmp) != 0 || rename(tmp, path) != 0) {
+    unlink(tmp);
+    return -1;
+  }
+  return evict(dir, max_bytes);
+}
+
+CacheCounters cache_count(const char *dir, int hits, int misses, int evictions) {
+  CacheCounters c = { 0, 0, 0 };
+  char path[4096];
+  snprintf(path, sizeof(path), "%s/counters", dir);
+
+  FILE *fp = fopen(path, "r");
+  if (fp != NULL) {
+    if (fscanf(fp, "hits %llu misses %llu evictions %llu", &c.hits, &c.misses, &c.evictions) != 3) {
+      c.hits = c.misses = c.evictions = 0;
+    }
+    fclose(fp);
+  }
+
+  c.hits += hits;
+  c.misses += misses;
+  c.evictions += evictions;
+
+  mkdir(dir, 0777);
+  fp = fopen(path, "w");
+  if (fp != NULL) {
+    fprintf(fp, "hits %llu\nmisses %llu\nevictions %llu\n", c.hits, c.misses, c.evictions);
+    fclose(fp);
+  }
+  return c;
+}
@@ -0,0 +1,38 @@
+#ifndef CACHE_H
+#define CACHE_H
+
+#include <stddef.h>
+
+/* Content-addressed result cache: a directory holding one file per
+ * result, named by a 64-bit key (<16 hex digits>.ppm). The modification
+ * time of an entry is its last use, and the least recently used entries
+ * are evicted once the directory grows past its size cap. */
+
+/* counters kept in the cache directory across runs */
+typedef struct {
+  unsigned long long hits;
+  unsigned long long misses;
+  unsigned long long evictions;
+} CacheCounters;
+
+/* 64-bit xxHash (XXH64) of len bytes; pass the previous result as seed
+ * to hash data that arrives in pieces */
+unsigned long long hash64( const void * data , size_t len , unsigned long long seed );
+
+/* XXH64 of a whole file's contents, chained through seed; returns seed
+ * unchanged if the file can't be read */
+unsigned long long hash64_file( const char * path , unsigned long long seed );
+
+/* copy the entry for key to dest and mark it as just used;
+ * returns 0 on a hit, -1 if there is no such entry or the copy failed */
+int cache_fetch( const char * dir , unsigned long long key , const char * dest );
+
+/* copy src into the cache as the entry for key (creating dir if needed),
+ * then evict least recently used entries until the cache holds at most
+ * max_bytes; returns the number of evicted entries, or -1 on error */
+int cache_store( const char * dir , unsigned long long key , const char * src , long long max_bytes );
+
+/* add to the counters stored in dir and return the new totals */
+CacheCounters cache_count( const char * dir , int hits , int misses , int evictions );
+
+#endif
@@ -1,220 +1,2184 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <limits.h>
+#include <string.h>
 #include <math.h>
 #include <time.h>
 #include <assert.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
 #include "image_manip.h"
 #include "ppm_io.h"
+#include "thread_pool.h"
+#include "trace.h"
 
 double* gauss_matrix(double sigma);
-Image apply_filter(double* g_filter, Image im1, Image im2, double sigma);
-Image handleCase1(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
-Image handleCase2(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
-Image handleCase3(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
-Image handleCase4(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
+static int gauss_size(double sigma);
+static void handleCase1(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
+static void handleCase2(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
+static void handleCase3(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
+static void handleCase4(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows);
+
+/*
+reusable state for the _into functions: the pool that runs the
+bands, a grow-only scratch buffer and the last Gaussian matrix
+*/
+struct ImageContext {
+  ThreadPool *pool;
+  int owns_pool;
+
+  void *scratch;
+  size_t scratch_size;
+
+  double *gauss;
+  double gauss_sigma;
+};
+
+ImageContext *context_create(int nthreads) {
+  ImageContext *ctx = calloc(1, sizeof(ImageContext));
+  if (ctx == NULL) {
+    return NULL;
+  }
+
+  //share the process-wide pool unless asked for a specific size
+  if (nthreads > 0) {
+    ctx->pool = pool_create(nthreads);
+    ctx->owns_pool = 1;
+  } else {
+    ctx->pool = default_pool();
+  }
+  if (ctx->pool == NULL) {
+    free(ctx);
+    return NULL;
+  }
+  return ctx;
+}
+
+void context_destroy(ImageContext *ctx) {
+  if (ctx == NULL) {
+    return;
+  }
+  if (ctx->owns_pool) {
+    pool_destroy(ctx->pool);
+  }
+  free(ctx->scratch);
+  free(ctx->gauss);
+  free(ctx);
+}
+
+static ThreadPool *ctx_pool(ImageContext *ctx) {
+  return ctx != NULL ? ctx->pool : default_pool();
+}
+
+int context_threads(ImageContext *ctx) {
+  return pool_size(ctx_pool(ctx));
+}
+
+/*
+scratch memory for one call: the context's buffer (grown if needed)
+or, without a context, a fresh allocation released by scratch_release
+*/
+static void *scratch_get(ImageContext *ctx, size_t size) {
+  if (ctx == NULL) {
+    return malloc(size);
+  }
+  if (ctx->scratch_size < size) {
+    void *grown = realloc(ctx->scratch, size);
+    if (grown == NULL) {
+      return NULL;
+    }
+    ctx->scratch = grown;
+    ctx->scratch_size = size;
+  }
+  return ctx->scratch;
+}
+
+/* scratch_get for count items of size bytes; NULL if that overflows */
+static void *scratch_get_n(ImageContext *ctx, size_t count, size_t size) {
+  if (size != 0 && count > SIZE_MAX / size) {
+    return NULL;
+  }
+  return scratch_get(ctx, count * size);
+}
+
+static void scratch_release(ImageContext *ctx, void *p) {
+  if (ctx == NULL) {
+    free(p);
+  }
+}
+
+/*
+Gaussian matrix for sigma, reusing the context's copy when
+sigma has not changed since the last call
+*/
+static double *gauss_get(ImageContext *ctx, double sigma) {
+  if (ctx == NULL) {
+    return gauss_matrix(sigma);
+  }
+  if (ctx->gauss == NULL || ctx->gauss_sigma != sigma) {
+    free(ctx->gauss);
+    ctx->gauss = gauss_matrix(sigma);
+    ctx->gauss_sigma = sigma;
+  }
+  return ctx->gauss;
+}
+
+static void gauss_release(ImageContext *ctx, double *g) {
+  if (ctx == NULL) {
+    free(g);
+  }
+}
+
+static int valid_image(const Image im) {
+  return im.data != NULL && im.rows > 0 && im.cols > 0 && im.stride >= im.cols;
+}
+
+static int same_dims(const Image a, const Image b) {
+  return a.rows == b.rows && a.cols == b.cols;
+}
+
+typedef struct {
+  Image in;
+  Image out;
+} MapJob;
+
+/*
+Color matrix: every output channel is an affine mix of the input
+channels. The coefficients are quantized to int16 with as many
+fractional bits (up to 12) as the largest one allows, so the kernel is
+integer only. On SSE2 the row is treated as a byte stream: output byte
+j (channel c of its pixel) is sum over d = -2..2 of W_d[j] * in[j + d],
+where W_d[j] is the coefficient of channel c + d, or 0 if that falls
+outside the pixel. The weights repeat every 24 bytes (8 pixels), so
+three sets of constants cover the row and each 8 byte group is three
+_mm_madd_epi16 steps; the pack instructions do the clamping.
+*/
+#define MATRIX_MAX_SHIFT 12
+
+typedef struct {
+  Image in;
+  Image out;
+  int coef[3][3];    // quantized m[c][0..2]
+  int offset[3];     // quantized m[c][3] plus the rounding term
+  int shift;
+#ifdef __SSE2__
+  __m128i taps[3][2][3];  // per 8 byte group and half: (W_-2, W_-1), (W_0, W_1), (W_2, 0)
+  __m128i offs[3][2];
+#endif
+} MatrixJob;
+
+static inline unsigned char matrix_value(const MatrixJob *job, int c, Pixel p) {
+  int v = job->coef[c][0] * p.r + job->coef[c][1] * p.g + job->coef[c][2] * p.b + job->offset[c];
+  v = v < 0 ? 0 : v >> job->shift;
+  return v > 255 ? 255 : (unsigned char)v;
+}
+
+static inline Pixel matrix_pixel(const MatrixJob *job, Pixel p) {
+  Pixel q;
+  q.r = matrix_value(job, 0, p);
+  q.g = matrix_value(job, 1, p);
+  q.b = matrix_value(job, 2, p);
+  return q;
+}
+
+#ifdef __SSE2__
+/* weight of input byte j + d for output byte j, where j % 3 == c */
+static int matrix_tap(const MatrixJob *job, int c, int d) {
+  return (c + d < 0 || c + d > 2) ? 0 : job->coef[c][c + d];
+}
+
+static void matrix_simd_setup(MatrixJob *job) {
+  for (int group = 0; group < 3; group++) {
+    for (int half = 0; half < 2; half++) {
+      short pairs[3][8];
+      int offs[4];
+      for (int lane = 0; lane < 4; lane++) {
+        int c = (group * 8 + half * 4 + lane) % 3;
+        for (int k = 0; k < 3; k++) {
+          pairs[k][2 * lane] = (short)matrix_tap(job, c, 2 * k - 2);
+          pairs[k][2 * lane + 1] = k < 2 ? (short)matrix_tap(job, c, 2 * k - 1) : 0;
+        }
+        offs[lane] = job->offset[c];
+      }
+      for (int k = 0; k < 3; k++) {
+        job->taps[group][half][k] = _mm_loadu_si128((const __m128i *)pairs[k]);
+      }
+      job->offs[group][half] = _mm_setr_epi32(offs[0], offs[1], offs[2], offs[3]);
+    }
+  }
+}
+
+/* 8 output bytes starting at p, which has 2 readable bytes before it and 10 after */
+static inline __m128i matrix_group(const MatrixJob *job, const unsigned char *p, int group) {
+  __m128i zero = _mm_setzero_si128();
+  __m128i v[5];
+  for (int d = 0; d < 5; d++) {
+    v[d] = _mm_unpacklo_epi8(_mm_loadl_epi64((const __m128i *)(p + d - 2)), zero);
+  }
+
+  __m128i sum[2];
+  for (int half = 0; half < 2; half++) {
+    const __m128i *t = job->taps[group][half];
+    __m128i a = half ? _mm_unpackhi_epi16(v[0], v[1]) : _mm_unpacklo_epi16(v[0], v[1]);
+    __m128i b = half ? _mm_unpackhi_epi16(v[2], v[3]) : _mm_unpacklo_epi16(v[2], v[3]);
+    __m128i c = half ? _mm_unpackhi_epi16(v[4], zero) : _mm_unpacklo_epi16(v[4], zero);
+    __m128i s = _mm_add_epi32(_mm_madd_epi16(a, t[0]), _mm_madd_epi16(b, t[1]));
+    s = _mm_add_epi32(s, _mm_madd_epi16(c, t[2]));
+    s = _mm_add_epi32(s, job->offs[group][half]);
+    sum[half] = _mm_srai_epi32(s, job->shift);
+  }
+  __m128i words = _mm_packs_epi32(sum[0], sum[1]);
+  return _mm_packus_epi16(words, words);
+}
+#endif
+
+static void matrix_band(void *arg, int band, int begin, int end) {
+  MatrixJob *job = arg;
+  (void)band;
+
+  for (int y = begin; y < end; y++) {
+    const Pixel *src = image_row(job->in, y);
+    Pixel *dst = image_row(job->out, y);
+    int x = 0;
+
+#ifdef __SSE2__
+    //groups of 8 pixels whose shifted loads stay inside the row
+    if (job->in.cols >= 10) {
+      dst[0] = matrix_pixel(job, src[0]);
+      for (x = 1; x + 9 <= job->in.cols; x += 8) {
+        const unsigned char *p = (const unsigned char *)(src + x);
+        __m128i g0 = matrix_group(job, p, 0);
+        __m128i g1 = matrix_group(job, p + 8, 1);
+        __m128i g2 = matrix_group(job, p + 16, 2);
+        //every load is done before the stores, so in and out may be the same image
+        unsigned char *q = (unsigned char *)(dst + x);
+        _mm_storel_epi64((__m128i *)q, g0);
+        _mm_storel_epi64((__m128i *)(q + 8), g1);
+        _mm_storel_epi64((__m128i *)(q + 16), g2);
+      }
+    }
+#endif
+
+    for (; x < job->in.cols; x++) {
+      dst[x] = matrix_pixel(job, src[x]);
+    }
+  }
+}
+
+/*
+quantizes m into job; returns IM_ERR_ARGS if a coefficient or offset is
+out of range
+*/
+static int matrix_setup(MatrixJob *job, const double m[12]) {
+  for (int c = 0; c < 3; c++) {
+    for (int k = 0; k < 3; k++) {
+      if (!(fabs(m[4 * c + k]) <= COLOR_MATRIX_MAX)) {
+        return IM_ERR_ARGS;
+      }
+    }
+    if (!(fabs(m[4 * c + 3]) <= COLOR_MATRIX_MAX_OFFSET)) {
+      return IM_ERR_ARGS;
+    }
+  }
+
+  //as many fractional bits as the largest coefficient leaves room for in an int16
+  job->shift = MATRIX_MAX_SHIFT;
+  for (int c = 0; c < 3; c++) {
+    for (int k = 0; k < 3; k++) {
+      while (fabs(m[4 * c + k]) * (1 << job->shift) > 32767.0) {
+        job->shift--;
+      }
+    }
+  }
+
+  double one = 1 << job->shift;
+  for (int c = 0; c < 3; c++) {
+    for (int k = 0; k < 3; k++) {
+      job->coef[c][k] = (int)lround(m[4 * c + k] * one);
+    }
+    job->offset[c] = (int)lround(m[4 * c + 3] * one) + (job->shift > 0 ? 1 << (job->shift - 1) : 0);
+  }
+
+#ifdef __SSE2__
+  matrix_simd_setup(job);
+#endif
+  return IM_OK;
+}
+
+static int matrix_run(ImageContext *ctx, const Image in, Image out, const double m[12], const char *name) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out)) {
+    return IM_ERR_ARGS;
+  }
+
+  MatrixJob job;
+  job.in = in;
+  job.out = out;
+  if (matrix_setup(&job, m) != IM_OK) {
+    return IM_ERR_ARGS;
+  }
+
+  unsigned long long t0 = trace_now();
+  pool_rows(ctx_pool(ctx), in.rows, matrix_band, &job);
+  trace_span("kernel", name, t0, -1);
+
+  return IM_OK;
+}
+
+int color_matrix_into(ImageContext *ctx, const Image in, Image out, const double m[12]) {
+  return matrix_run(ctx, in, out, m, "color-matrix");
+}
+
+Image color_matrix(const Image in, const double m[12]) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && color_matrix_into(NULL, in, out, m) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+/*
+table of named color matrices, one row of four per output channel
+*/
+static const struct {
+  const char *name;
+  double m[12];
+} color_matrix_presets[] = {
+  { "grayscale", { 0.3,   0.59,  0.11,  0,
+                   0.3,   0.59,  0.11,  0,
+                   0.3,   0.59,  0.11,  0 } },
+  { "sepia",     { 0.393, 0.769, 0.189, 0,
+                   0.349, 0.686, 0.168, 0,
+                   0.272, 0.534, 0.131, 0 } },
+  { "invert",    { -1,    0,     0,     255,
+                   0,     -1,    0,     255,
+                   0,     0,     -1,    255 } },
+  { "bgr",       { 0,     0,     1,     0,
+                   0,     1,     0,     0,
+                   1,     0,     0,     0 } },
+};
+
+int color_matrix_preset(const char *name, double m[12]) {
+  for (size_t i = 0; i < sizeof(color_matrix_presets) / sizeof(color_matrix_presets[0]); i++) {
+    if (strcmp(name, color_matrix_presets[i].name) == 0) {
+      memcpy(m, color_matrix_presets[i].m, sizeof(double) * 12);
+      return 0;
+    }
+  }
+  return -1;
+}
+
+void saturate_matrix(double scale, double m[12]) {
+  static const double gray[3] = { 0.3, 0.59, 0.11 };
+  for (int c = 0; c < 3; c++) {
+    for (int k = 0; k < 3; k++) {
+      m[4 * c + k] = (1 - scale) * gray[k] + (c == k ? scale : 0);
+    }
+    m[4 * c + 3] = 0;
+  }
+}
+
+int grayscale_into(ImageContext *ctx, const Image in, Image out) {
+  double m[12];
+  color_matrix_preset("grayscale", m);
+  return matrix_run(ctx, in, out, m, "grayscale");
+}
 
 Image grayscale(const Image in) {
     Image gray_image = make_image(in.rows, in.cols);
 
-    int num_pix = in.rows * in.cols;
-    
-    //iterate through all pixels
-    for (int i = 0; i < num_pix; i++) {
-      int r = (in.data[i]).r;
-      int g = (in.data[i]).g;
-      int b = (in.data[i]).b;
+    if (gray_image.data != NULL && grayscale_into(NULL, in, gray_image) != IM_OK) {
+      free_image(&gray_image);
+    }
+
+    return gray_image;
+}
+
+typedef struct {
+  Image in1;
+  Image in2;
+  Image out;
+  double alpha;
+  int min_rows;
+  int min_cols;
+} BlendJob;
+
+static void blend_band(void *arg, int band, int begin, int end) {
+  BlendJob *job = arg;
+  double alpha = job->alpha;
+  (void)band;
+
+  for (int i = begin; i < end; i++) {
+    Pixel *dst = image_row(job->out, i);
+
+    //initialize row to black
+    memset(dst, 0, sizeof(Pixel) * job->out.cols);
+
+    if (i >= job->min_rows) {
+      continue;
+    }
+
+    //overlapped quadrant
+    const Pixel *a = image_row(job->in1, i);
+    const Pixel *b = image_row(job->in2, i);
+    for (int j = 0; j < job->min_cols; j++) {
+      double r = ((double)(a[j].r) * alpha) + ((double)(b[j].r) * (1 - alpha));
+      dst[j].r = (int)r;
+
+      double g = (double)(a[j].g) * alpha + (double)(b[j].g) * (1 - alpha);
+      dst[j].g = (int)g;
+
+      double bl = (double)(a[j].b) * alpha + (double)(b[j].b) * (1 - alpha);
+      dst[j].b = (int)bl;
+    }
+  }
+}
+
+int blend_into(ImageContext *ctx, const Image in1, const Image in2, Image out, double alpha) {
+    if (!valid_image(in1) || !valid_image(in2) || !valid_image(out)) {
+      return IM_ERR_ARGS;
+    }
+
+    //calculate image parameters
+    int min_rows = fmin(in1.rows, in2.rows);
+    int max_rows = fmax(in1.rows, in2.rows);
+    int min_cols = fmin(in1.cols, in2.cols);
+    int max_cols = fmax(in1.cols, in2.cols);
+
+    if (out.rows != max_rows || out.cols != max_cols) {
+      return IM_ERR_ARGS;
+    }
+
+    //black background plus the overlapped quadrant
+    BlendJob job = { in1, in2, out, alpha, min_rows, min_cols };
+    unsigned long long t0 = trace_now();
+    pool_rows(ctx_pool(ctx), max_rows, blend_band, &job);
+    trace_span("kernel", "blend", t0, -1);
+
+    //Handles the remaining pixels that aren't overlapped in four cases
+
+    // 1 is a subset of 2
+    handleCase1(in1, in2, out, max_cols, min_cols, min_rows, max_rows);
+
+    //2 is a subset of 1
+    handleCase2(in1, in2, out, max_cols, min_cols, min_rows, max_rows);
+
+    //im2 is longer vertically than im1 and im1 is longer horizontally
+    handleCase3(in1, in2, out, max_cols, min_cols, min_rows, max_rows);
+
+    //im2 is longer horizontally and im1 is longer vertically
+    handleCase4(in1, in2, out, max_cols, min_cols, min_rows, max_rows);
+
+    return IM_OK;
+}
+
+Image blend(const Image in1, const Image in2, double alpha) {
+    Image blend_image = make_image(fmax(in1.rows, in2.rows), fmax(in1.cols, in2.cols));
+
+    if (blend_image.data != NULL && blend_into(NULL, in1, in2, blend_image, alpha) != IM_OK) {
+      free_image(&blend_image);
+    }
+
+    return blend_image;
+}
+
+
+static void rotate_band(void *arg, int band, int begin, int end) {
+  MapJob *job = arg;
+  (void)band;
+
+  //iteratively transpose image
+  for (int i = begin; i < end; i++) {
+    const Pixel *src = image_row(job->in, i);
+    for (int j = 0; j < job->in.cols; j++) {
+      image_row(job->out, job->in.cols - j - 1)[i] = src[j];
+    }
+  }
+}
+
+int rotate_ccw_into(ImageContext *ctx, const Image in, Image out) {
+  if (!valid_image(in) || !valid_image(out) || out.rows != in.cols || out.cols != in.rows) {
+    return IM_ERR_ARGS;
+  }
+
+  MapJob job = { in, out };
+  unsigned long long t0 = trace_now();
+  pool_rows(ctx_pool(ctx), in.rows, rotate_band, &job);
+  trace_span("kernel", "rotate-ccw", t0, -1);
+
+  return IM_OK;
+}
+
+Image rotate_ccw(const Image in) {
+    Image rotated_image = make_image(in.cols, in.rows);
+
+    if (rotated_image.data != NULL && rotate_ccw_into(NULL, in, rotated_image) != IM_OK) {
+      free_image(&rotated_image);
+    }
+
+    return rotated_image;
+}
+
+
+int pointilism_into(ImageContext *ctx, const Image in, Image out) {
+    if (!valid_image(in) || !valid_image(out) || !same_dims(in, out)) {
+      return IM_ERR_ARGS;
+    }
+    (void)ctx;
+
+    size_t num_pix = (size_t)in.rows * in.cols;
+    unsigned long long t0 = trace_now();
+
+    //initialize output image to black
+    for (int i = 0; i < out.rows; i++) {
+      memset(image_row(out, i), 0, sizeof(Pixel) * out.cols);
+    }
+
+    //iterate through number of randomly generated pixels
+    for (size_t k = 0; k < (num_pix * 0.03); k++) {
+      int rand_col = rand() % (in.cols);
+      int rand_row = rand() % (in.rows);
+      int radius = rand() % 5 + 1;
+
+      Pixel rand_pixel = image_row(in, rand_row)[rand_col];
+
+      //iterate through pixels around the given pixel
+      for (int i = -radius; i <= radius; i++) {
+        int row_pos = rand_row + i;
+        //check that the row is not off the top or bottom of the image
+        if (row_pos < 0 || row_pos >= in.rows) {
+          continue;
+        }
+        Pixel *dst = image_row(out, row_pos);
+
+        for (int j = -radius; j <= radius; j++) {
+          int col_pos = rand_col + j;
+          //check that pixel is within the circle of radius radius
+          //and not off the left or right edge of the image
+          if (i * i + j * j <= radius * radius && col_pos >= 0 && col_pos < in.cols) {
+            dst[col_pos] = rand_pixel;
+          }
+        }
+      }
+    }
+    trace_span("kernel", "pointilism", t0, -1);
+
+    return IM_OK;
+}
+
+Image pointilism(const Image in) {
+    Image pointilism_image = make_image(in.rows, in.cols);
+
+    if (pointilism_image.data != NULL && pointilism_into(NULL, in, pointilism_image) != IM_OK) {
+      free_image(&pointilism_image);
+    }
+
+    return pointilism_image;
+}
+
+
+typedef struct {
+  Image in;
+  Image out;
+  const double *g_filter;
+  int N;
+} BlurJob;
+
+/*
+Applies the gauss matrix created in the g_matrix function to row y
+of the image, writing the blurred row to dst and renormalizing where
+the matrix hangs off the edge of the image
+*/
+static void blur_row(const BlurJob *job, int y, Pixel *dst) {
+  Image im1 = job->in;
+  const double *g_filter = job->g_filter;
+  int N = job->N;
+  int center = N / 2;
+
+    for (int x = 0; x < im1.cols; x++) {
+	  //initialize running sums for rgb values and normalizing sum
+	      double r_sum = 0.0;
+        double g_sum = 0.0;
+        double b_sum = 0.0;
+        double norm = 0.0;
+	    //iterate through pixels around the given pixel
+	    for (int i = -center; i <= center; i++) {
+        int yy = y + i;
+        //check that it is not indexing outside the edges of the image
+        if (yy < 0 || yy >= im1.rows) {
+          continue;
+        }
+        const Pixel *src = image_row(im1, yy);
+        for (int j = -center; j <= center; j++) {
+          int xx = x + j;
+		      if (xx >= 0 && xx < im1.cols) {
+            double w = g_filter[(size_t)(i + center) * N + (j + center)];
+            r_sum += src[xx].r * w;
+            g_sum += src[xx].g * w;
+            b_sum += src[xx].b * w;
+            norm += w;
+          }
+        }
+      }
+
+	    //normalize the sums
+        dst[x].r = (unsigned char)(r_sum / norm);
+        dst[x].g = (unsigned char)(g_sum / norm);
+        dst[x].b = (unsigned char)(b_sum / norm);
+    }
+}
+
+static void blur_band(void *arg, int band, int begin, int end) {
+  BlurJob *job = arg;
+  (void)band;
+
+    //iterate through rows in the band
+  for (int y = begin; y < end; y++) {
+    blur_row(job, y, image_row(job->out, y));
+  }
+}
+
+int blur_into(ImageContext *ctx, const Image in, Image out, double sigma) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || !(sigma > 0 && sigma <= BLUR_MAX_SIGMA)) {
+    return IM_ERR_ARGS;
+  }
+
+  //generate gaussian matrix
+  double* g_matrix = gauss_get(ctx, sigma);
+  if (g_matrix == NULL) {
+        fprintf(stderr, "Error: Gaussian matrix generation failed.\n");
+        return IM_ERR_NOMEM;
+    }
+
+  //apply the convolution
+  BlurJob job = { in, out, g_matrix, gauss_size(sigma) };
+  unsigned long long t0 = trace_now();
+  pool_rows(ctx_pool(ctx), in.rows, blur_band, &job);
+  trace_span("kernel", "blur", t0, -1);
+
+  gauss_release(ctx, g_matrix);
+
+  return IM_OK;
+}
+
+Image blur(const Image in, double sigma) {
+
+  Image blur_image = make_image(in.rows, in.cols);
+
+  if (blur_image.data != NULL && blur_into(NULL, in, blur_image, sigma) != IM_OK) {
+    free_image(&blur_image);
+  }
+
+  return blur_image;
+}
+
+int saturate_into(ImageContext *ctx, const Image in, Image out, double scale) {
+  if (!(scale >= 0)) {
+    return IM_ERR_ARGS;
+  }
+
+  double m[12];
+  saturate_matrix(scale, m);
+  return matrix_run(ctx, in, out, m, "saturate");
+}
+
+Image saturate(const Image in, double scale) {
+  Image saturate_image = make_image(in.rows, in.cols);
+
+  if (saturate_image.data != NULL && saturate_into(NULL, in, saturate_image, scale) != IM_OK) {
+    free_image(&saturate_image);
+  }
+
+  return saturate_image;
+}
+
+/*
+luma value with the grayscale weights, in integer math so
+every thread agrees on the bucket
+*/
+static inline int luma(Pixel p) {
+  return (30 * p.r + 59 * p.g + 11 * p.b) / 100;
+}
+
+typedef struct {
+  Image in;
+  unsigned long long *hists;  // bands * STAT_CHANNELS * 256 counters
+} StatsJob;
+
+static void stats_band(void *arg, int band, int begin, int end) {
+  StatsJob *job = arg;
+  unsigned long long *h = job->hists + (size_t)band * STAT_CHANNELS * 256;
+
+  for (int y = begin; y < end; y++) {
+    const Pixel *src = image_row(job->in, y);
+    for (int x = 0; x < job->in.cols; x++) {
+      Pixel p = src[x];
+      h[0 * 256 + p.r]++;
+      h[1 * 256 + p.g]++;
+      h[2 * 256 + p.b]++;
+      h[STAT_LUMA * 256 + luma(p)]++;
+    }
+  }
+}
+
+int image_stats_into(ImageContext *ctx, const Image in, ImageStats *st) {
+  memset(st, 0, sizeof(*st));
+  if (!valid_image(in)) {
+    return IM_ERR_ARGS;
+  }
+
+  ThreadPool *pool = ctx_pool(ctx);
+  int bands = pool_band_count(pool, in.rows);
+  size_t hist_size = (size_t)bands * STAT_CHANNELS * 256 * sizeof(unsigned long long);
+  StatsJob job = { in, scratch_get(ctx, hist_size) };
+  if (job.hists == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    return IM_ERR_NOMEM;
+  }
+  memset(job.hists, 0, hist_size);
+
+  //one private histogram per band, merged afterwards
+  unsigned long long t0 = trace_now();
+  pool_rows(pool, in.rows, stats_band, &job);
+  trace_span("kernel", "stats", t0, -1);
+  for (int b = 0; b < bands; b++) {
+    for (int c = 0; c < STAT_CHANNELS; c++) {
+      for (int v = 0; v < 256; v++) {
+        st->hist[c][v] += job.hists[((size_t)b * STAT_CHANNELS + c) * 256 + v];
+      }
+    }
+  }
+  scratch_release(ctx, job.hists);
+
+  //everything else falls out of the histograms
+  st->count = (unsigned long long)in.rows * in.cols;
+  for (int c = 0; c < STAT_CHANNELS; c++) {
+    double sum = 0.0;
+    st->min[c] = 255;
+    st->max[c] = 0;
+    for (int v = 0; v < 256; v++) {
+      if (st->hist[c][v] == 0) {
+        continue;
+      }
+      if (v < st->min[c]) {
+        st->min[c] = v;
+      }
+      st->max[c] = v;
+      sum += (double)v * st->hist[c][v];
+    }
+    st->mean[c] = st->count ? sum / st->count : 0.0;
+  }
+
+  return IM_OK;
+}
+
+ImageStats image_stats(const Image in) {
+  ImageStats st;
+  image_stats_into(NULL, in, &st);
+  return st;
+}
+
+int stats_percentile(const ImageStats *st, int channel, double pct) {
+  double target = st->count * (pct / 100.0);
+  unsigned long long seen = 0;
+
+  for (int v = 0; v < 256; v++) {
+    seen += st->hist[channel][v];
+    if (seen > 0 && seen >= target) {
+      return v;
+    }
+  }
+  return 255;
+}
+
+typedef struct {
+  Image in;
+  Image out;
+  unsigned char lut[3][256];
+} LevelsJob;
+
+static void levels_band(void *arg, int band, int begin, int end) {
+  LevelsJob *job = arg;
+  (void)band;
+
+  for (int y = begin; y < end; y++) {
+    const Pixel *src = image_row(job->in, y);
+    Pixel *dst = image_row(job->out, y);
+    for (int x = 0; x < job->in.cols; x++) {
+      dst[x].r = job->lut[0][src[x].r];
+      dst[x].g = job->lut[1][src[x].g];
+      dst[x].b = job->lut[2][src[x].b];
+    }
+  }
+}
+
+int auto_levels_into(ImageContext *ctx, const Image in, Image out, double low_pct, double high_pct) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out)) {
+    return IM_ERR_ARGS;
+  }
+
+  ImageStats st;
+  int rc = image_stats_into(ctx, in, &st);
+  if (rc != IM_OK) {
+    return rc;
+  }
+
+  LevelsJob job;
+  job.in = in;
+  job.out = out;
+
+  //build a linear stretch for each channel
+  for (int c = 0; c < 3; c++) {
+    int lo = stats_percentile(&st, c, low_pct);
+    int hi = stats_percentile(&st, c, high_pct);
+
+    for (int v = 0; v < 256; v++) {
+      if (hi <= lo) {
+        job.lut[c][v] = v;
+      } else if (v <= lo) {
+        job.lut[c][v] = 0;
+      } else if (v >= hi) {
+        job.lut[c][v] = 255;
+      } else {
+        job.lut[c][v] = (unsigned char)((v - lo) * 255 / (hi - lo));
+      }
+    }
+  }
+
+  unsigned long long t0 = trace_now();
+  pool_rows(ctx_pool(ctx), in.rows, levels_band, &job);
+  trace_span("kernel", "auto-levels", t0, -1);
+
+  return IM_OK;
+}
+
+Image auto_levels(const Image in, double low_pct, double high_pct) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && auto_levels_into(NULL, in, out, low_pct, high_pct) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+Kernel make_kernel(int size) {
+  Kernel k;
+  k.weights = calloc((size_t)size * size, sizeof(int));
+  k.size = size;
+  k.divisor = 1;
+  k.bias = 0;
+  return k;
+}
+
+void free_kernel(Kernel *k) {
+  free(k->weights);
+  k->weights = NULL;
+}
+
+/*
+table of named kernels; the divisor and bias are chosen so the
+output stays in a viewable range
+*/
+static const struct {
+  const char *name;
+  int size;
+  int divisor;
+  int bias;
+  int weights[25];
+} kernel_presets[] = {
+  { "sharpen",   3,  1,   0, {  0, -1,  0,  -1,  5, -1,   0, -1,  0 } },
+  { "sobel-x",   3,  1, 128, { -1,  0,  1,  -2,  0,  2,  -1,  0,  1 } },
+  { "sobel-y",   3,  1, 128, { -1, -2, -1,   0,  0,  0,   1,  2,  1 } },
+  { "emboss",    3,  1, 128, { -2, -1,  0,  -1,  1,  1,   0,  1,  2 } },
+  { "laplacian", 3,  1, 128, {  0,  1,  0,   1, -4,  1,   0,  1,  0 } },
+  { "box",       3,  9,   0, {  1,  1,  1,   1,  1,  1,   1,  1,  1 } },
+  { "gaussian5", 5, 256,  0, {  1,  4,  6,  4,  1,
+                                4, 16, 24, 16,  4,
+                                6, 24, 36, 24,  6,
+                                4, 16, 24, 16,  4,
+                                1,  4,  6,  4,  1 } },
+};
+
+Kernel kernel_preset(const char *name) {
+  for (size_t i = 0; i < sizeof(kernel_presets) / sizeof(kernel_presets[0]); i++) {
+    if (strcmp(name, kernel_presets[i].name) == 0) {
+      Kernel k = make_kernel(kernel_presets[i].size);
+      if (k.weights != NULL) {
+        memcpy(k.weights, kernel_presets[i].weights, sizeof(int) * k.size * k.size);
+        k.divisor = kernel_presets[i].divisor;
+        k.bias = kernel_presets[i].bias;
+      }
+      return k;
+    }
+  }
+  Kernel none = { NULL, 0, 1, 0 };
+  return none;
+}
+
+Kernel read_kernel(FILE *fp) {
+  Kernel none = { NULL, 0, 1, 0 };
+
+  int size;
+  if (fscanf(fp, "%d", &size) != 1 || size <= 0 || size % 2 == 0 || size > KERNEL_MAX_SIZE) {
+    fprintf(stderr, "Error: kernel size must be an odd number between 1 and %d\n", KERNEL_MAX_SIZE);
+    return none;
+  }
+
+  Kernel k = make_kernel(size);
+  if (k.weights == NULL) {
+    fprintf(stderr, "Error: Memory allocation failed.\n");
+    return k;
+  }
+
+  //255 * sum(|w|) must fit the int accumulators
+  long long sum = 0, sum_abs = 0;
+  for (int i = 0; i < size * size; i++) {
+    if (fscanf(fp, "%d", &k.weights[i]) != 1) {
+      fprintf(stderr, "Error: kernel file has fewer than %d taps\n", size * size);
+      free_kernel(&k);
+      return none;
+    }
+    sum += k.weights[i];
+    sum_abs += k.weights[i] < 0 ? -(long long)k.weights[i] : k.weights[i];
+    if (sum_abs > INT_MAX / 255) {
+      fprintf(stderr, "Error: kernel taps are too large (255 times their absolute sum must fit an int)\n");
+      free_kernel(&k);
+      return none;
+    }
+  }
+
+  //divisor and bias are optional
+  k.divisor = sum > 0 ? (int)sum : 1;
+  if (fscanf(fp, "%d", &k.divisor) == 1 && k.divisor <= 0) {
+    fprintf(stderr, "Error: kernel divisor must be positive\n");
+    free_kernel(&k);
+    return none;
+  }
+  if (fscanf(fp, "%d", &k.bias) != 1) {
+    k.bias = 0;
+  } else if (k.bias > KERNEL_MAX_BIAS || k.bias < -KERNEL_MAX_BIAS) {
+    fprintf(stderr, "Error: kernel bias must be within +-%d\n", KERNEL_MAX_BIAS);
+    free_kernel(&k);
+    return none;
+  }
+
+  return k;
+}
+
+/*
+scale an accumulated channel sum back to a pixel value
+*/
+static inline unsigned char conv_clamp(int sum, int divisor, int bias) {
+  int v = sum / divisor + bias;
+  return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+static inline int clamp_index(int i, int n) {
+  return i < 0 ? 0 : (i >= n ? n - 1 : i);
+}
+
+/*
+slow path for pixels near the border: neighbours outside the
+image are replaced by the nearest edge pixel
+*/
+static void conv_border(const Kernel *k, Image in, Image out, int y, int x0, int x1) {
+  int n = k->size;
+  int center = n / 2;
+
+  for (int x = x0; x < x1; x++) {
+    int r = 0, g = 0, b = 0;
+    for (int i = 0; i < n; i++) {
+      const Pixel *row = image_row(in, clamp_index(y + i - center, in.rows));
+      for (int j = 0; j < n; j++) {
+        const Pixel *q = &row[clamp_index(x + j - center, in.cols)];
+        int w = k->weights[i * n + j];
+        r += w * q->r;
+        g += w * q->g;
+        b += w * q->b;
+      }
+    }
+    Pixel *p = &image_row(out, y)[x];
+    p->r = conv_clamp(r, k->divisor, k->bias);
+    p->g = conv_clamp(g, k->divisor, k->bias);
+    p->b = conv_clamp(b, k->divisor, k->bias);
+  }
+}
+
+/*
+interior pixels of any kernel size: the whole footprint is known to
+be inside the image so there is no per-tap bounds check
+*/
+static void conv_interior(const Kernel *k, Image in, Image out, int y, int x0, int x1) {
+  int n = k->size;
+  int center = n / 2;
+
+  for (int x = x0; x < x1; x++) {
+    const Pixel *origin = &image_row(in, y - center)[x - center];
+    int r = 0, g = 0, b = 0;
+    for (int i = 0; i < n; i++) {
+      const Pixel *row = origin + (size_t)i * in.stride;
+      for (int j = 0; j < n; j++) {
+        int w = k->weights[i * n + j];
+        r += w * row[j].r;
+        g += w * row[j].g;
+        b += w * row[j].b;
+      }
+    }
+    Pixel *p = &image_row(out, y)[x];
+    p->r = conv_clamp(r, k->divisor, k->bias);
+    p->g = conv_clamp(g, k->divisor, k->bias);
+    p->b = conv_clamp(b, k->divisor, k->bias);
+  }
+}
+
+/*
+fully unrolled interiors for 3x3 and 5x5 kernels. The taps are copied
+into a local array so the compiler can keep them in registers instead
+of reloading them after every store to the output.
+*/
+#define CONV_TAP(n, i, j) \
+  do { \
+    const Pixel *q = origin + (size_t)(i) * stride + (j); \
+    int t = w[(i) * (n) + (j)]; \
+    r += t * q->r; \
+    g += t * q->g; \
+    b += t * q->b; \
+  } while (0)
+
+#define CONV_ROW3(i) CONV_TAP(3, i, 0); CONV_TAP(3, i, 1); CONV_TAP(3, i, 2)
+#define CONV_ROW5(i) CONV_TAP(5, i, 0); CONV_TAP(5, i, 1); CONV_TAP(5, i, 2); \
+                     CONV_TAP(5, i, 3); CONV_TAP(5, i, 4)
+#define CONV_SUM3 CONV_ROW3(0); CONV_ROW3(1); CONV_ROW3(2)
+#define CONV_SUM5 CONV_ROW5(0); CONV_ROW5(1); CONV_ROW5(2); CONV_ROW5(3); CONV_ROW5(4)
+
+#define DEFINE_CONV_INTERIOR(n, SUM) \
+  static void conv_interior_##n(const Kernel *k, Image in, Image out, int y, int x0, int x1) { \
+    int w[(n) * (n)]; \
+    memcpy(w, k->weights, sizeof(w)); \
+    const int divisor = k->divisor; \
+    const int bias = k->bias; \
+    const int stride = in.stride; \
+    const Pixel *top = image_row(in, y - (n) / 2); \
+    Pixel *dst = image_row(out, y); \
+    for (int x = x0; x < x1; x++) { \
+      const Pixel *origin = &top[x - (n) / 2]; \
+      int r = 0, g = 0, b = 0; \
+      SUM; \
+      Pixel *p = &dst[x]; \
+      p->r = conv_clamp(r, divisor, bias); \
+      p->g = conv_clamp(g, divisor, bias); \
+      p->b = conv_clamp(b, divisor, bias); \
+    } \
+  }
+
+DEFINE_CONV_INTERIOR(3, CONV_SUM3)
+DEFINE_CONV_INTERIOR(5, CONV_SUM5)
+
+typedef void (*conv_row_fn)(const Kernel *k, Image in, Image out, int y, int x0, int x1);
+
+typedef struct {
+  const Kernel *k;
+  Image in;
+  Image out;
+  conv_row_fn interior;
+} ConvJob;
+
+static void convolve_band(void *arg, int band, int begin, int end) {
+  ConvJob *job = arg;
+  int center = job->k->size / 2;
+  int rows = job->in.rows;
+  int cols = job->in.cols;
+  (void)band;
+
+  for (int y = begin; y < end; y++) {
+    if (y >= center && y < rows - center && cols > 2 * center) {
+      conv_border(job->k, job->in, job->out, y, 0, center);
+      job->interior(job->k, job->in, job->out, y, center, cols - center);
+      conv_border(job->k, job->in, job->out, y, cols - center, cols);
+    } else {
+      conv_border(job->k, job->in, job->out, y, 0, cols);
+    }
+  }
+}
+
+int convolve_into(ImageContext *ctx, const Image in, Image out, const Kernel *k) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || k == NULL || k->weights == NULL || k->size % 2 == 0 || k->divisor <= 0) {
+    return IM_ERR_ARGS;
+  }
+
+  ConvJob job;
+  job.k = k;
+  job.in = in;
+  job.out = out;
+
+  //pick the specialised interior loop if there is one
+  switch (k->size) {
+  case 3:
+    job.interior = conv_interior_3;
+    break;
+  case 5:
+    job.interior = conv_interior_5;
+    break;
+  default:
+    job.interior = conv_interior;
+    break;
+  }
+
+  unsigned long long t0 = trace_now();
+  pool_rows(ctx_pool(ctx), in.rows, convolve_band, &job);
+  trace_span("kernel", "convolve", t0, -1);
+
+  return IM_OK;
+}
+
+Image convolve(const Image in, const Kernel *k) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && convolve_into(NULL, in, out, k) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+/*
+Affine warps run over the output in WARP_TILE x WARP_TILE tiles. The
+inverse map is quantized once to WARP_FRAC fractional bits, so source
+coordinates advance by a constant integer step along each row instead
+of being recomputed with floating point for every pixel.
+*/
+#define WARP_FRAC 24
+#define WARP_ONE ((long long)1 << WARP_FRAC)
+#define WARP_TILE 64
+
+typedef struct {
+  long long a, b, c;  // source column u = a*x + b*y + c
+  long long d, e, f;  // source row    v = d*x + e*y + f
+} WarpMap;
+
+/*
+inverts the forward matrix and quantizes it, folding in the half pixel
+so that (x, y) = (0, 0) samples at the center of the first output pixel;
+extent is the larger output dimension
+*/
+static int warp_map(const double m[6], int extent, WarpMap *w) {
+  double det = m[0] * m[4] - m[1] * m[3];
+  if (!(fabs(det) > 1e-12)) {
+    return IM_ERR_ARGS;
+  }
+
+  double ia = m[4] / det;
+  double ib = -m[1] / det;
+  double id = -m[3] / det;
+  double ie = m[0] / det;
+  double ic = -(ia * m[2] + ib * m[5]);
+  double jf = -(id * m[2] + ie * m[5]);
+
+  double coef[6] = { ia, ib, ia * 0.5 + ib * 0.5 + ic, id, ie, id * 0.5 + ie * 0.5 + jf };
+  for (int i = 0; i < 6; i++) {
+    //keep a*x + b*y + c inside 64 bits for every x, y up to extent
+    double reach = i % 3 == 2 ? 1.0 : (double)extent + 1.0;
+    if (!(fabs(coef[i]) * reach < (double)(1LL << 37))) {
+      return IM_ERR_ARGS;
+    }
+  }
+  w->a = llround(coef[0] * WARP_ONE);
+  w->b = llround(coef[1] * WARP_ONE);
+  w->c = llround(coef[2] * WARP_ONE);
+  w->d = llround(coef[3] * WARP_ONE);
+  w->e = llround(coef[4] * WARP_ONE);
+  w->f = llround(coef[5] * WARP_ONE);
+  return IM_OK;
+}
+
+/*
+splits a fixed point coordinate, shifted back by half a pixel, into the
+two neighbouring indices (clamped to the image) and an 8 bit weight
+*/
+static inline void warp_split(long long u, int n, int *i0, int *i1, int *w) {
+  long long t = u - WARP_ONE / 2;
+  int i = t < 0 ? -1 : (int)(t >> WARP_FRAC);
+  *w = (int)((t - i * WARP_ONE) >> (WARP_FRAC - 8));
+  *i0 = i < 0 ? 0 : i;
+  *i1 = i + 1 >= n ? n - 1 : i + 1;
+}
+
+static inline Pixel warp_sample(const Image in, long long u, long long v, int bilinear) {
+  Pixel p = { 0, 0, 0 };
+
+  //outside the source image stays black
+  if (u < 0 || v < 0 || u >= in.cols * WARP_ONE || v >= in.rows * WARP_ONE) {
+    return p;
+  }
+  if (!bilinear) {
+    return image_row(in, (int)(v >> WARP_FRAC))[u >> WARP_FRAC];
+  }
+
+  int x0, x1, wx, y0, y1, wy;
+  warp_split(u, in.cols, &x0, &x1, &wx);
+  warp_split(v, in.rows, &y0, &y1, &wy);
+
+  const Pixel *top = image_row(in, y0);
+  const Pixel *bot = image_row(in, y1);
+  int w00 = (256 - wx) * (256 - wy);
+  int w01 = wx * (256 - wy);
+  int w10 = (256 - wx) * wy;
+  int w11 = wx * wy;
+
+  p.r = (top[x0].r * w00 + top[x1].r * w01 + bot[x0].r * w10 + bot[x1].r * w11 + 32768) >> 16;
+  p.g = (top[x0].g * w00 + top[x1].g * w01 + bot[x0].g * w10 + bot[x1].g * w11 + 32768) >> 16;
+  p.b = (top[x0].b * w00 + top[x1].b * w01 + bot[x0].b * w10 + bot[x1].b * w11 + 32768) >> 16;
+  return p;
+}
+
+typedef struct {
+  Image in;
+  Image out;
+  WarpMap w;
+  int bilinear;
+  int tiles_x;
+} WarpJob;
+
+static void warp_tile(void *arg, int tile) {
+  WarpJob *job = arg;
+  const WarpMap *w = &job->w;
+  int x0 = (tile % job->tiles_x) * WARP_TILE;
+  int y0 = (tile / job->tiles_x) * WARP_TILE;
+  int x1 = x0 + WARP_TILE < job->out.cols ? x0 + WARP_TILE : job->out.cols;
+  int y1 = y0 + WARP_TILE < job->out.rows ? y0 + WARP_TILE : job->out.rows;
+  unsigned long long t0 = trace_now();
+
+  for (int y = y0; y < y1; y++) {
+    Pixel *dst = image_row(job->out, y);
+    long long u = w->a * x0 + w->b * y + w->c;
+    long long v = w->d * x0 + w->e * y + w->f;
+
+    for (int x = x0; x < x1; x++) {
+      dst[x] = warp_sample(job->in, u, v, job->bilinear);
+      u += w->a;
+      v += w->d;
+    }
+  }
+  trace_span("pool", "tile", t0, tile);
+}
+
+int affine_into(ImageContext *ctx, const Image in, Image out, const double m[6], int bilinear) {
+  if (!valid_image(in) || !valid_image(out) || in.data == out.data) {
+    return IM_ERR_ARGS;
+  }
+
+  WarpJob job;
+  job.in = in;
+  job.out = out;
+  job.bilinear = bilinear;
+  job.tiles_x = (out.cols + WARP_TILE - 1) / WARP_TILE;
+  if (warp_map(m, out.rows > out.cols ? out.rows : out.cols, &job.w) != IM_OK) {
+    return IM_ERR_ARGS;
+  }
+
+  int tiles_y = (out.rows + WARP_TILE - 1) / WARP_TILE;
+  unsigned long long t0 = trace_now();
+  pool_run(ctx_pool(ctx), job.tiles_x * tiles_y, warp_tile, &job);
+  trace_span("kernel", "affine", t0, -1);
+
+  return IM_OK;
+}
+
+Image affine(const Image in, const double m[6], int bilinear) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && affine_into(NULL, in, out, m, bilinear) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+void rotation_matrix(int in_rows, int in_cols, int out_rows, int out_cols, double degrees, double m[6]) {
+  double pi = 3.14159265358979323846;
+  double c = cos(degrees * pi / 180.0);
+  double s = sin(degrees * pi / 180.0);
+  double cx = in_cols / 2.0;
+  double cy = in_rows / 2.0;
+
+  //y points down, so counter-clockwise moves a point right of center upwards
+  m[0] = c;
+  m[1] = s;
+  m[2] = out_cols / 2.0 - c * cx - s * cy;
+  m[3] = -s;
+  m[4] = c;
+  m[5] = out_rows / 2.0 + s * cx - c * cy;
+}
+
+int rotate_into(ImageContext *ctx, const Image in, Image out, double degrees, int bilinear) {
+  double m[6];
+  rotation_matrix(in.rows, in.cols, out.rows, out.cols, degrees, m);
+  return affine_into(ctx, in, out, m, bilinear);
+}
+
+Image rotate(const Image in, double degrees, int bilinear) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && rotate_into(NULL, in, out, degrees, bilinear) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+/*
+Median filter after Perreault and Hebert: every column keeps a
+histogram of the 2r+1 pixels above and below the current row, and the
+window histogram is updated by adding the column entering on the right
+and removing the one leaving on the left, so the cost per pixel does
+not depend on the radius. Histograms have 16 coarse bins of 16 fine
+bins each; the search walks the coarse bins and only the one fine
+segment that holds the median is brought up to date, lazily.
+Columns are processed in strips of MEDIAN_STRIP so a band's column
+histograms stay in cache.
+*/
+#define MEDIAN_STRIP 256
 
-      //calculate grayscale value
-      int gray_int = 0.3 * r + 0.59 * g + 0.11 * b;
-      unsigned char gray = (unsigned char)gray_int;
+typedef struct {
+  unsigned int coarse[16];
+  unsigned int fine[256];
+  int fine_at[16];  // x each fine segment was last brought up to date for
+} MedianHist;
 
-      //assign grayscale value
-      (gray_image.data[i]).r = gray;
-      (gray_image.data[i]).g =	gray;
-      (gray_image.data[i]).b =	gray;
+typedef struct {
+  Image in;
+  Image out;
+  int radius;
+  size_t band_size;  // scratch bytes per band
+  unsigned char *scratch;
+} MedianJob;
+
+/* add (dir = 1) or remove (dir = -1) row y of columns [c0, c1) */
+static void median_columns(const Image in, int y, int c0, int c1, int dir,
+                           unsigned short *fine, unsigned short *coarse) {
+  const Pixel *row = image_row(in, y);
+  for (int cx = c0; cx < c1; cx++) {
+    const unsigned char *p = &row[cx].r;
+    unsigned short *f = fine + (size_t)(cx - c0) * 3 * 256;
+    unsigned short *c = coarse + (size_t)(cx - c0) * 3 * 16;
+    for (int ch = 0; ch < 3; ch++) {
+      f[ch * 256 + p[ch]] += dir;
+      c[ch * 16 + (p[ch] >> 4)] += dir;
     }
-      
-    return gray_image;
+  }
 }
 
-Image blend(const Image in1, const Image in2, double alpha) {
-    Image blend_image = make_image(fmax(in1.rows, in2.rows), fmax(in1.cols, in2.cols));
+/*
+brings fine segment b of the window histogram for channel ch up to
+date for the window centered on column x
+*/
+static void median_fine(MedianHist *h, int b, int ch, int x, int r, int cols, int c0,
+                        const unsigned short *fine) {
+  unsigned int *seg = h->fine + b * 16;
+  int at = h->fine_at[b];
 
-    //calculate image parameters
-    int min_rows = fmin(in1.rows, in2.rows);
-    int max_rows = fmax(in1.rows, in2.rows);
-    int min_cols = fmin(in1.cols, in2.cols);
-    int max_cols = fmax(in1.cols, in2.cols);
+  if (x - at > r) {
+    //too stale: rebuild from the 2r+1 columns
+    memset(seg, 0, sizeof(unsigned int) * 16);
+    for (int xx = x - r; xx <= x + r; xx++) {
+      const unsigned short *f = fine + ((size_t)(clamp_index(xx, cols) - c0) * 3 + ch) * 256 + b * 16;
+      for (int i = 0; i < 16; i++) {
+        seg[i] += f[i];
+      }
+    }
+  } else {
+    for (int t = at + 1; t <= x; t++) {
+      const unsigned short *add = fine + ((size_t)(clamp_index(t + r, cols) - c0) * 3 + ch) * 256 + b * 16;
+      const unsigned short *sub = fine + ((size_t)(clamp_index(t - r - 1, cols) - c0) * 3 + ch) * 256 + b * 16;
+      for (int i = 0; i < 16; i++) {
+        seg[i] += add[i] - sub[i];
+      }
+    }
+  }
+  h->fine_at[b] = x;
+}
 
-    int num_pix = max_rows * max_cols; 
-    
-    //initialize new image to black
-    for (int i = 0; i < num_pix; i++) {
-      blend_image.data[i].r = 0;
-      blend_image.data[i].g = 0;
-      blend_image.data[i].b = 0;
+static void median_band(void *arg, int band, int begin, int end) {
+  MedianJob *job = arg;
+  Image in = job->in;
+  int r = job->radius;
+  int rows = in.rows;
+  int cols = in.cols;
+  unsigned int half = (unsigned int)((2 * r + 1) * (2 * r + 1)) / 2;
+
+  MedianHist *hist = (MedianHist *)(job->scratch + job->band_size * band);
+  unsigned short *fine = (unsigned short *)(hist + 3);
+  size_t max_cols = (job->band_size - 3 * sizeof(MedianHist)) / (sizeof(unsigned short) * 3 * (256 + 16));
+  unsigned short *coarse = fine + max_cols * 3 * 256;
+
+  for (int sx0 = 0; sx0 < cols; sx0 += MEDIAN_STRIP) {
+    int sx1 = sx0 + MEDIAN_STRIP < cols ? sx0 + MEDIAN_STRIP : cols;
+    //columns the windows of this strip can reach
+    int c0 = sx0 - r < 0 ? 0 : sx0 - r;
+    int c1 = sx1 + r > cols ? cols : sx1 + r;
+
+    memset(fine, 0, sizeof(unsigned short) * 3 * 256 * (c1 - c0));
+    memset(coarse, 0, sizeof(unsigned short) * 3 * 16 * (c1 - c0));
+    for (int yy = begin - r; yy <= begin + r; yy++) {
+      median_columns(in, clamp_index(yy, rows), c0, c1, 1, fine, coarse);
     }
-    
-    //overlapped quadrant
-    for (int i = 0; i < min_rows; i++) {
-      for (int j = 0; j < min_cols; j++) {
-	      double r = ((double)(in1.data[i * in1.cols + j].r) * alpha) + ((double)(in2.data[i * in2.cols + j].r) * (1 - alpha));
-        
-        
-        blend_image.data[i * max_cols + j].r = (int)r; 
-        
-        double g = (double)(in1.data[i * in1.cols + j].g) * alpha + (double)(in2.data[i * in2.cols + j].g) * (1 - alpha);
-	      blend_image.data[i * max_cols + j].g = (int)g; 
 
-        double b = (double)(in1.data[i * in1.cols + j].b) * alpha + (double)(in2.data[i * in2.cols + j].b) * (1 - alpha);
-	      blend_image.data[i * max_cols + j].b = (int)b; 
+    for (int y = begin; y < end; y++) {
+      if (y > begin) {
+        median_columns(in, clamp_index(y - r - 1, rows), c0, c1, -1, fine, coarse);
+        median_columns(in, clamp_index(y + r, rows), c0, c1, 1, fine, coarse);
+      }
+
+      //coarse window histograms for the first column of the strip
+      for (int ch = 0; ch < 3; ch++) {
+        memset(hist[ch].coarse, 0, sizeof(hist[ch].coarse));
+        for (int b = 0; b < 16; b++) {
+          hist[ch].fine_at[b] = sx0 - 2 * r - 2;
+        }
+        for (int xx = sx0 - r; xx <= sx0 + r; xx++) {
+          const unsigned short *c = coarse + ((size_t)(clamp_index(xx, cols) - c0) * 3 + ch) * 16;
+          for (int b = 0; b < 16; b++) {
+            hist[ch].coarse[b] += c[b];
+          }
+        }
+      }
+
+      Pixel *out = image_row(job->out, y);
+      for (int x = sx0; x < sx1; x++) {
+        if (x > sx0) {
+          const unsigned short *add = coarse + (size_t)(clamp_index(x + r, cols) - c0) * 3 * 16;
+          const unsigned short *sub = coarse + (size_t)(clamp_index(x - r - 1, cols) - c0) * 3 * 16;
+          for (int i = 0; i < 16; i++) {
+            hist[0].coarse[i] += add[i] - sub[i];
+            hist[1].coarse[i] += add[16 + i] - sub[16 + i];
+            hist[2].coarse[i] += add[32 + i] - sub[32 + i];
+          }
+        }
+
+        unsigned char *px = &out[x].r;
+        for (int ch = 0; ch < 3; ch++) {
+          MedianHist *h = &hist[ch];
+          //find the coarse bin holding the median, then the fine bin
+          unsigned int seen = 0;
+          int b = 0;
+          while (seen + h->coarse[b] <= half) {
+            seen += h->coarse[b++];
+          }
+          median_fine(h, b, ch, x, r, cols, c0, fine);
+          int v = b * 16;
+          while (seen + h->fine[v] <= half) {
+            seen += h->fine[v++];
+          }
+          px[ch] = (unsigned char)v;
+        }
       }
     }
+  }
+}
 
-    //Handles the remaining pixels that aren't overlapped in four cases
-    
-    // 1 is a subset of 2
-    blend_image = handleCase1(in1, in2, blend_image, max_cols, min_cols, min_rows, max_rows);
+int median_into(ImageContext *ctx, const Image in, Image out, int radius) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || radius < 1 || radius > MEDIAN_MAX_RADIUS) {
+    return IM_ERR_ARGS;
+  }
 
-    //2 is a subset of 1
-    blend_image = handleCase2(in1, in2, blend_image, max_cols, min_cols, min_rows, max_rows);
+  ThreadPool *pool = ctx_pool(ctx);
+  int strip_cols = MEDIAN_STRIP + 2 * radius < in.cols ? MEDIAN_STRIP + 2 * radius : in.cols;
+  MedianJob job;
+  job.in = in;
+  job.out = out;
+  job.radius = radius;
+  job.band_size = 3 * sizeof(MedianHist)
+                  + sizeof(unsigned short) * 3 * (256 + 16) * (size_t)strip_cols;
+  //keep every band's block aligned for the histogram counters
+  job.band_size = (job.band_size + 63) & ~(size_t)63;
+  job.scratch = scratch_get(ctx, job.band_size * pool_band_count(pool, in.rows));
+  if (job.scratch == NULL) {
+    return IM_ERR_NOMEM;
+  }
 
-    //im2 is longer vertically than im1 and im1 is longer horizontally
-    blend_image = handleCase3(in1, in2, blend_image, max_cols, min_cols, min_rows, max_rows);
+  unsigned long long t0 = trace_now();
+  pool_rows(pool, in.rows, median_band, &job);
+  trace_span("kernel", "median", t0, -1);
 
-    //im2 is longer horizontally and im1 is longer vertically
-    blend_image = handleCase4(in1, in2, blend_image, max_cols, min_cols, min_rows, max_rows);
+  scratch_release(ctx, job.scratch);
+  return IM_OK;
+}
 
-    return blend_image;
+Image median(const Image in, int radius) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && median_into(NULL, in, out, radius) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
 }
 
+typedef struct {
+  BlurJob blur;
+  double amount;
+  int threshold;
+  Pixel *rows;  // one blurred row per band
+} UnsharpJob;
 
-Image rotate_ccw(const Image in) {
-    Image rotated_image = make_image(in.cols, in.rows);
-    
-    //iteratively transpose image
-    for (int i = 0; i < in.rows; i++) {
-      for (int j = 0; j < in.cols; j++) {
-	rotated_image.data[(in.cols - j - 1) * in.rows + i] = in.data[i * in.cols + j];
-      }
+/*
+one channel of the unsharp mask: the difference from the blurred
+value, scaled by amount, is added back if it reaches the threshold
+*/
+static inline unsigned char unsharp_value(int orig, int blurred, double amount, int threshold) {
+  int diff = orig - blurred;
+  if (abs(diff) < threshold) {
+    return (unsigned char)orig;
+  }
+  int v = (int)floor(orig + amount * diff + 0.5);
+  return (unsigned char)(v < 0 ? 0 : (v > 255 ? 255 : v));
+}
+
+/*
+blurs each row of the band into the band's row buffer and combines it
+with the original right away, so the blurred image is never stored
+*/
+static void unsharp_band(void *arg, int band, int begin, int end) {
+  UnsharpJob *job = arg;
+  Pixel *blurred = job->rows + (size_t)band * job->blur.in.cols;
+
+  for (int y = begin; y < end; y++) {
+    blur_row(&job->blur, y, blurred);
+    const Pixel *src = image_row(job->blur.in, y);
+    Pixel *dst = image_row(job->blur.out, y);
+    for (int x = 0; x < job->blur.in.cols; x++) {
+      dst[x].r = unsharp_value(src[x].r, blurred[x].r, job->amount, job->threshold);
+      dst[x].g = unsharp_value(src[x].g, blurred[x].g, job->amount, job->threshold);
+      dst[x].b = unsharp_value(src[x].b, blurred[x].b, job->amount, job->threshold);
     }
-    
-    return rotated_image; 
+  }
 }
 
+int unsharp_into(ImageContext *ctx, const Image in, Image out, double sigma, double amount, int threshold) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || !(sigma > 0 && sigma <= BLUR_MAX_SIGMA) || amount < 0 || threshold < 0) {
+    return IM_ERR_ARGS;
+  }
 
-Image pointilism(const Image in) {
-    Image pointilism_image = make_image(in.rows, in.cols);
+  ThreadPool *pool = ctx_pool(ctx);
+  Pixel *rows = scratch_get(ctx, sizeof(Pixel) * in.cols * pool_band_count(pool, in.rows));
+  if (rows == NULL) {
+    return IM_ERR_NOMEM;
+  }
+  double *g_matrix = gauss_get(ctx, sigma);
+  if (g_matrix == NULL) {
+    scratch_release(ctx, rows);
+    return IM_ERR_NOMEM;
+  }
 
-    int num_pix = in.rows * in.cols;
+  UnsharpJob job = { { in, out, g_matrix, gauss_size(sigma) }, amount, threshold, rows };
+  unsigned long long t0 = trace_now();
+  pool_rows(pool, in.rows, unsharp_band, &job);
+  trace_span("kernel", "unsharp", t0, -1);
 
-    //initialize output image to black
-    for (int i = 0; i < num_pix; i++) {
-      pointilism_image.data[i].r = 0;
-      pointilism_image.data[i].g = 0;
-      pointilism_image.data[i].b = 0;
+  gauss_release(ctx, g_matrix);
+  scratch_release(ctx, rows);
+
+  return IM_OK;
+}
+
+Image unsharp(const Image in, double sigma, double amount, int threshold) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && unsharp_into(NULL, in, out, sigma, amount, threshold) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+/*
+Stacking combines n images of the same size pixel by pixel. Mean sums
+each row of all inputs into a per-band accumulator (16 bit while the
+sums fit, else 32 bit), one input at a time so the inner loop is a
+straight run over the row; min and max fold the inputs into the output
+row directly; median gathers the n values of each pixel.
+*/
+typedef struct {
+  const Image *in;
+  int n;
+  Image out;
+  StackMode mode;
+  size_t band_size;  // scratch bytes per band
+  unsigned char *scratch;
+} StackJob;
+
+#define DEFINE_STACK_SUM(NAME, ACC)                                           \
+  static void NAME(const StackJob *job, int y, void *scratch) {               \
+    ACC *acc = scratch;                                                       \
+    size_t len = (size_t)job->out.cols * 3;                                   \
+    memset(acc, 0, sizeof(ACC) * len);                                        \
+    for (int i = 0; i < job->n; i++) {                                        \
+      const unsigned char *src = &image_row(job->in[i], y)->r;                \
+      for (size_t x = 0; x < len; x++) {                                      \
+        acc[x] += src[x];                                                     \
+      }                                                                       \
+    }                                                                         \
+    unsigned char *dst = &image_row(job->out, y)->r;                          \
+    unsigned int half = job->n / 2;                                           \
+    for (size_t x = 0; x < len; x++) {                                        \
+      dst[x] = (unsigned char)((acc[x] + half) / job->n);                     \
+    }                                                                         \
+  }
+
+DEFINE_STACK_SUM(stack_mean_16, unsigned short)
+DEFINE_STACK_SUM(stack_mean_32, unsigned int)
+
+static void stack_extreme(const StackJob *job, int y) {
+  size_t len = (size_t)job->out.cols * 3;
+  unsigned char *dst = &image_row(job->out, y)->r;
+  memcpy(dst, image_row(job->in[0], y), len);
+  for (int i = 1; i < job->n; i++) {
+    const unsigned char *src = &image_row(job->in[i], y)->r;
+    if (job->mode == STACK_MAX) {
+      for (size_t x = 0; x < len; x++) {
+        dst[x] = src[x] > dst[x] ? src[x] : dst[x];
+      }
+    } else {
+      for (size_t x = 0; x < len; x++) {
+        dst[x] = src[x] < dst[x] ? src[x] : dst[x];
+      }
     }
+  }
+}
 
-    //iterate through number of randomly generated pixels
-    for (int k = 0; k < (num_pix * 0.03); k++) {
-      int rand_col = rand() % (in.cols);
-      int rand_row = rand() % (in.rows); 
-      int radius = rand() % 5 + 1;
+/* up to this many values, median_of sorts them in place */
+#define MEDIAN_SORT_MAX 32
+
+/*
+median of n values, which it may reorder: an insertion sort for a few
+values, else a counting sort, since they are bytes; an even count
+averages the two middle values
+*/
+static unsigned char median_of(unsigned char *v, int n) {
+  if (n <= MEDIAN_SORT_MAX) {
+    for (int i = 1; i < n; i++) {
+      unsigned char x = v[i];
+      int j = i;
+      for (; j > 0 && v[j - 1] > x; j--) {
+        v[j] = v[j - 1];
+      }
+      v[j] = x;
+    }
+    return (unsigned char)((v[(n - 1) / 2] + v[n / 2] + 1) / 2);
+  }
 
-      Pixel rand_pixel = in.data[rand_row * in.cols + rand_col]; 
+  unsigned short count[256] = { 0 };
+  for (int i = 0; i < n; i++) {
+    count[v[i]]++;
+  }
+  int lo = -1, hi = -1, seen = 0;
+  for (int b = 0; hi < 0; b++) {
+    seen += count[b];
+    if (lo < 0 && seen > (n - 1) / 2) {
+      lo = b;
+    }
+    if (seen > n / 2) {
+      hi = b;
+    }
+  }
+  return (unsigned char)((lo + hi + 1) / 2);
+}
 
-      int r = rand_pixel.r;
-      int g = rand_pixel.g;
-      int b = rand_pixel.b;
+static void stack_median(const StackJob *job, int y, unsigned char *values) {
+  size_t len = (size_t)job->out.cols * 3;
+  unsigned char *dst = &image_row(job->out, y)->r;
+  for (size_t x = 0; x < len; x++) {
+    for (int i = 0; i < job->n; i++) {
+      values[i] = (&image_row(job->in[i], y)->r)[x];
+    }
+    dst[x] = median_of(values, job->n);
+  }
+}
 
-      //iterate through pixels around the given pixel
-      for (int i = -radius; i <= radius; i++) {
-	  for (int j = -radius; j <= radius; j++) {
-	    //check that pixel is within the circle of radius radius
-            if (pow(i, 2) + pow(j, 2) <= pow(radius, 2)) {
-	
-              int index = (rand_row * in.cols + rand_col) + i * in.cols + j;
-	            int col_pos = rand_col + j;
-		    //check that indexed pixels is not off any edge of the image
-	            if ((index < 0) || (index > num_pix) || (col_pos > in.cols) || (col_pos < 0)) {
-		      continue;
-		    }
-
-	            pointilism_image.data[index].r = r;
-	            pointilism_image.data[index].g = g;
-	            pointilism_image.data[index].b = b;
-	          }
+static void stack_band(void *arg, int band, int begin, int end) {
+  StackJob *job = arg;
+  void *scratch = job->scratch + job->band_size * band;
 
-	      }
+  for (int y = begin; y < end; y++) {
+    switch (job->mode) {
+    case STACK_MEAN:
+      //255 * n must fit the accumulator
+      if (job->n <= 257) {
+        stack_mean_16(job, y, scratch);
+      } else {
+        stack_mean_32(job, y, scratch);
       }
+      break;
+    case STACK_MEDIAN:
+      stack_median(job, y, scratch);
+      break;
+    default:
+      stack_extreme(job, y);
+      break;
+    }
+  }
+}
+
+int stack_into(ImageContext *ctx, const Image *in, int n, Image out, StackMode mode) {
+  if (in == NULL || n < 1 || n > STACK_MAX_IMAGES || !valid_image(out)) {
+    return IM_ERR_ARGS;
+  }
+  for (int i = 0; i < n; i++) {
+    if (!valid_image(in[i]) || !same_dims(in[i], out) || in[i].data == out.data) {
+      return IM_ERR_ARGS;
+    }
+  }
+
+  ThreadPool *pool = ctx_pool(ctx);
+  StackJob job = { in, n, out, mode, 0, NULL };
+  if (mode == STACK_MEAN) {
+    job.band_size = sizeof(unsigned int) * 3 * (size_t)out.cols;
+  } else if (mode == STACK_MEDIAN) {
+    job.band_size = n;
+  }
+  if (job.band_size > 0) {
+    //keep every band's accumulator aligned
+    job.band_size = (job.band_size + 63) & ~(size_t)63;
+    job.scratch = scratch_get(ctx, job.band_size * pool_band_count(pool, out.rows));
+    if (job.scratch == NULL) {
+      return IM_ERR_NOMEM;
     }
+  }
 
+  unsigned long long t0 = trace_now();
+  pool_rows(pool, out.rows, stack_band, &job);
+  trace_span("kernel", "stack", t0, n);
 
-    return pointilism_image; 
+  if (job.scratch != NULL) {
+    scratch_release(ctx, job.scratch);
+  }
+  return IM_OK;
 }
 
+Image stack(const Image *in, int n, StackMode mode) {
+  Image out = { NULL , 0 , 0 , 0 };
+  if (in == NULL || n < 1) {
+    return out;
+  }
+  out = make_image(in[0].rows, in[0].cols);
 
-Image blur(const Image in, double sigma) {
+  if (out.data != NULL && stack_into(NULL, in, n, out, mode) != IM_OK) {
+    free_image(&out);
+  }
 
-  Image blur_image = make_image(in.rows, in.cols);
+  return out;
+}
 
-  //generate gaussian matrix 
-  double* g_matrix = gauss_matrix(sigma);
-  if (g_matrix == NULL) {
-        fprintf(stderr, "Error: Gaussian matrix generation failed.\n");
-        return blur_image;
+/*
+Morphology with van Herk/Gil-Werman passes. A window of k samples is
+split at multiples of k: the minimum (or maximum) of any window is then
+the combination of a suffix of one block and a prefix of the next, so
+each sample costs three comparisons whatever k is. The rectangle is
+done as a horizontal pass over every row and a vertical pass that works
+on whole rows at a time; both combine with SIMD min/max over rows.
+Edge samples are replicated, so the window never reaches outside the
+image. Open and close run two such erode/dilate steps.
+*/
+typedef struct {
+  Image in;
+  Image out;
+  int k;        // window length along the pass
+  int use_max;
+  size_t band_size;
+  unsigned char *scratch;
+} MorphJob;
+
+/* dst = elementwise min or max of a and b, over len bytes */
+static void bytes_minmax(unsigned char *dst, const unsigned char *a, const unsigned char *b,
+                         size_t len, int use_max) {
+  size_t i = 0;
+#ifdef __SSE2__
+  if (use_max) {
+    for (; i + 16 <= len; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_max_epu8(va, vb));
+    }
+  } else {
+    for (; i + 16 <= len; i += 16) {
+      __m128i va = _mm_loadu_si128((const __m128i *)(a + i));
+      __m128i vb = _mm_loadu_si128((const __m128i *)(b + i));
+      _mm_storeu_si128((__m128i *)(dst + i), _mm_min_epu8(va, vb));
+    }
+  }
+#endif
+  if (use_max) {
+    for (; i < len; i++) {
+      dst[i] = a[i] > b[i] ? a[i] : b[i];
     }
+  } else {
+    for (; i < len; i++) {
+      dst[i] = a[i] < b[i] ? a[i] : b[i];
+    }
+  }
+}
 
-  //apply the convolution
-  blur_image = apply_filter(g_matrix, in, blur_image, sigma);
+/*
+horizontal pass: window [x - k/2, x - k/2 + k - 1] of every row. The
+scratch holds the row with its edges replicated, then the suffixes and
+prefixes of its blocks, all indexed by window start; output x is the
+combination of suffix[x] and prefix[x + k - 1], done for the whole row
+by one bytes_minmax
+*/
+static void morph_h_band(void *arg, int band, int begin, int end) {
+  MorphJob *job = arg;
+  int n = job->in.cols;
+  int k = job->k;
+  int lo = k / 2;
+  int m = n + k - 1;
+  int use_max = job->use_max;
+  unsigned char *ext = job->scratch + job->band_size * band;
+  unsigned char *suffix = ext + 3 * (size_t)m;
+  unsigned char *prefix = suffix + 3 * (size_t)m;
 
-  free(g_matrix);
+  for (int y = begin; y < end; y++) {
+    const Pixel *src = image_row(job->in, y);
+    for (int i = 0; i < lo; i++) {
+      memcpy(ext + 3 * i, &src[0], 3);
+    }
+    memcpy(ext + 3 * lo, src, 3 * (size_t)n);
+    for (int i = lo + n; i < m; i++) {
+      memcpy(ext + 3 * i, &src[n - 1], 3);
+    }
 
-  return blur_image; 
+    //byte runs of one block at a time; a channel's previous sample is 3 bytes away
+    for (size_t B = 0; B < 3 * (size_t)m; B += 3 * (size_t)k) {
+      size_t last = 3 * (size_t)m - B > 3 * (size_t)k ? B + 3 * (size_t)k - 1 : 3 * (size_t)m - 1;
+      memcpy(suffix + last - 2, ext + last - 2, 3);
+      memcpy(prefix + B, ext + B, 3);
+      if (use_max) {
+        for (size_t i = last - 3; i + 1 > B; i--) {
+          suffix[i] = suffix[i + 3] > ext[i] ? suffix[i + 3] : ext[i];
+        }
+        for (size_t i = B + 3; i <= last; i++) {
+          prefix[i] = prefix[i - 3] > ext[i] ? prefix[i - 3] : ext[i];
+        }
+      } else {
+        for (size_t i = last - 3; i + 1 > B; i--) {
+          suffix[i] = suffix[i + 3] < ext[i] ? suffix[i + 3] : ext[i];
+        }
+        for (size_t i = B + 3; i <= last; i++) {
+          prefix[i] = prefix[i - 3] < ext[i] ? prefix[i - 3] : ext[i];
+        }
+      }
+    }
+    bytes_minmax((unsigned char *)image_row(job->out, y), suffix, prefix + 3 * ((size_t)k - 1),
+                 3 * (size_t)n, use_max);
+  }
 }
 
-Image saturate(const Image in, double scale) {
-  Image saturate_image = make_image(in.rows, in.cols);
+/*
+vertical pass: the same blocks, with whole rows as the samples. Bands
+are counted in blocks, so each block's suffix rows are built once and
+every output row costs three row operations however tall k is; the
+scratch holds k suffix rows and the running prefix
+*/
+static void morph_v_band(void *arg, int band, int begin, int end) {
+  MorphJob *job = arg;
+  int rows = job->in.rows;
+  size_t len = sizeof(Pixel) * job->in.cols;
+  int k = job->k;
+  int lo = k / 2;
+  int use_max = job->use_max;
+  unsigned char *suffix = job->scratch + job->band_size * band;
+  unsigned char *prefix = suffix + len * k;
+
+#define ROW_BYTES(im, y) ((unsigned char *)image_row((im), clamp_index((y), rows)))
+  for (int b = begin; b < end; b++) {
+    //window start of the block's first output row, b * k
+    int B = b * k - lo;
+    memcpy(suffix + len * (k - 1), ROW_BYTES(job->in, B + k - 1), len);
+    for (int j = k - 2; j >= 0; j--) {
+      bytes_minmax(suffix + len * j, suffix + len * (j + 1), ROW_BYTES(job->in, B + j), len, use_max);
+    }
+    memcpy(prefix, suffix + len * (k - 1), len);
+    for (int j = 0; j < k && B + j + lo < rows; j++) {
+      if (j > 0) {
+        bytes_minmax(prefix, prefix, ROW_BYTES(job->in, B + k - 1 + j), len, use_max);
+      }
+      bytes_minmax((unsigned char *)image_row(job->out, B + j + lo), suffix + len * j, prefix, len, use_max);
+    }
+  }
+#undef ROW_BYTES
+}
+
+/* one erode (use_max 0) or dilate (use_max 1) step from in to out through tmp */
+static void morph_step(ThreadPool *pool, MorphJob *job, Image in, Image tmp, Image out,
+                       int width, int height, int use_max) {
+  job->use_max = use_max;
+
+  job->in = in;
+  job->out = tmp;
+  job->k = width;
+  pool_rows(pool, in.rows, morph_h_band, job);
+
+  job->in = tmp;
+  job->out = out;
+  job->k = height;
+  pool_rows(pool, (in.rows + height - 1) / height, morph_v_band, job);
+}
+
+int morph_into(ImageContext *ctx, const Image in, Image out, MorphOp op, int width, int height) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || width < 1 || height < 1 || width > MORPH_MAX_SIZE || height > MORPH_MAX_SIZE
+      || op < MORPH_ERODE || op > MORPH_CLOSE) {
+    return IM_ERR_ARGS;
+  }
+
+  ThreadPool *pool = ctx_pool(ctx);
+  int bands = pool_band_count(pool, in.rows);
+  size_t len = sizeof(Pixel) * in.cols;
+  size_t h_size = sizeof(Pixel) * 3 * ((size_t)in.cols + width - 1);
+  size_t v_size = len * (height + 1);
+
+  MorphJob job;
+  job.band_size = h_size > v_size ? h_size : v_size;
+  job.band_size = (job.band_size + 63) & ~(size_t)63;
+
+  //the intermediate image, then each band's block buffers
+  size_t tmp_size = (image_bytes(in.rows, in.cols) + 63) & ~(size_t)63;
+  unsigned char *scratch = NULL;
+  if (job.band_size * bands <= SIZE_MAX - tmp_size) {
+    scratch = scratch_get(ctx, tmp_size + job.band_size * bands);
+  }
+  if (scratch == NULL) {
+    return IM_ERR_NOMEM;
+  }
+  Image tmp = { (Pixel *)scratch, in.rows, in.cols, in.cols };
+  job.scratch = scratch + tmp_size;
+
+  unsigned long long t0 = trace_now();
+  switch (op) {
+  case MORPH_ERODE:
+    morph_step(pool, &job, in, tmp, out, width, height, 0);
+    break;
+  case MORPH_DILATE:
+    morph_step(pool, &job, in, tmp, out, width, height, 1);
+    break;
+  case MORPH_OPEN:
+    morph_step(pool, &job, in, tmp, out, width, height, 0);
+    morph_step(pool, &job, out, tmp, out, width, height, 1);
+    break;
+  case MORPH_CLOSE:
+    morph_step(pool, &job, in, tmp, out, width, height, 1);
+    morph_step(pool, &job, out, tmp, out, width, height, 0);
+    break;
+  }
+  trace_span("kernel", "morph", t0, op);
+
+  scratch_release(ctx, scratch);
+  return IM_OK;
+}
+
+Image morph(const Image in, MorphOp op, int width, int height) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && morph_into(NULL, in, out, op, width, height) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
+}
+
+/*
+Bilateral filter on a bilateral grid (Paris and Durand; Chen et al.):
+every pixel is accumulated into the cell at (x / sigma_s, y / sigma_s,
+luma / sigma_r) of a coarse 3D grid of (r, g, b, count) sums, the grid
+is blurred with a [1 4 6 4 1] kernel along each axis, and each output
+pixel is read back by trilinear interpolation at its own position and
+luma. Pixels across an edge land far apart along the luma axis, so they
+do not mix. The work is linear in the pixels plus the grid cells; the
+splat and blur passes run over bands of grid rows so no two threads
+write the same cell, and the slice runs over bands of image rows.
+*/
+#define GRID_PAD 2
 
-  int num_pix = in.rows * in.cols;
+typedef struct {
+  Image in;
+  Image out;
+  double inv_s;   // 1 / sigma_s
+  double inv_r;   // 1 / sigma_r
+  int gw, gh, gd; // grid size along x, y and luma
+  float *grid;    // 4 floats per cell, luma innermost
+  float *tmp;
+  int axis;       // blur pass: 0 = x, 1 = y, 2 = luma
+} GridJob;
 
-  //iterate through number of pixels
-  for (int i = 0; i < num_pix; i++) {
-    int r = (in.data[i]).r;
-    int g = (in.data[i]).g;
-    int b = (in.data[i]).b;
+static inline size_t grid_cell(const GridJob *job, int gx, int gy, int gz) {
+  return (((size_t)gy * job->gw + gx) * job->gd + gz) * 4;
+}
+
+/* accumulates the pixels whose nearest grid row lies in [begin, end) */
+static void grid_splat_band(void *arg, int band, int begin, int end) {
+  GridJob *job = arg;
+  (void)band;
 
-    //make calculations
-    unsigned char gray = (unsigned char)(0.3 * r + 0.59 * g + 0.11 * b);
+  memset(job->grid + grid_cell(job, 0, begin, 0), 0,
+         sizeof(float) * 4 * (size_t)job->gw * job->gd * (end - begin));
 
-    int r_new = (in.data[i].r - gray) * scale + gray;
-    int b_new = (in.data[i].b - gray) * scale + gray;
-    int g_new = (in.data[i].g - gray) * scale + gray;
+  //rows that round to grid rows begin - 1 .. end, then filter exactly
+  int y0 = (int)((begin - GRID_PAD - 1) / job->inv_s);
+  int y1 = (int)((end - GRID_PAD + 1) / job->inv_s) + 1;
+  y0 = y0 < 0 ? 0 : y0;
+  y1 = y1 > job->in.rows ? job->in.rows : y1;
 
-    //check that value is within bounds of 0 - 255
-    if(r_new > 255) {
-      r_new = 255;
-    } else if (r_new < 0) {
-      r_new = 0; 
+  for (int y = y0; y < y1; y++) {
+    int gy = (int)(y * job->inv_s + 0.5) + GRID_PAD;
+    if (gy < begin || gy >= end) {
+      continue;
     }
-    if(b_new > 255) {
-      b_new = 255;
-    } else if (b_new < 0) {
-      b_new = 0; 
+    const Pixel *src = image_row(job->in, y);
+    for (int x = 0; x < job->in.cols; x++) {
+      int gx = (int)(x * job->inv_s + 0.5) + GRID_PAD;
+      int gz = (int)(luma(src[x]) * job->inv_r + 0.5) + GRID_PAD;
+      float *cell = job->grid + grid_cell(job, gx, gy, gz);
+      cell[0] += src[x].r;
+      cell[1] += src[x].g;
+      cell[2] += src[x].b;
+      cell[3] += 1.0f;
+    }
+  }
+}
+
+/* one [1 4 6 4 1] / 16 pass along job->axis, grid to tmp, for grid rows [begin, end) */
+static void grid_blur_band(void *arg, int band, int begin, int end) {
+  GridJob *job = arg;
+  static const float taps[5] = { 1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16 };
+  int n = job->axis == 0 ? job->gw : (job->axis == 1 ? job->gh : job->gd);
+  (void)band;
+
+  for (int gy = begin; gy < end; gy++) {
+    for (int gx = 0; gx < job->gw; gx++) {
+      for (int gz = 0; gz < job->gd; gz++) {
+        int pos = job->axis == 0 ? gx : (job->axis == 1 ? gy : gz);
+        float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+        for (int t = -2; t <= 2; t++) {
+          if (pos + t < 0 || pos + t >= n) {
+            continue;
+          }
+          const float *c = job->grid + grid_cell(job, gx + (job->axis == 0) * t,
+                                                 gy + (job->axis == 1) * t, gz + (job->axis == 2) * t);
+          for (int i = 0; i < 4; i++) {
+            sum[i] += taps[t + 2] * c[i];
+          }
+        }
+        memcpy(job->tmp + grid_cell(job, gx, gy, gz), sum, sizeof(sum));
+      }
     }
-    if(g_new > 255) {
-      g_new = 255;
-    } else if (g_new < 0) {
-      g_new = 0; 
+  }
+}
+
+/* reads every output pixel back from the blurred grid */
+static void grid_slice_band(void *arg, int band, int begin, int end) {
+  GridJob *job = arg;
+  (void)band;
+
+  for (int y = begin; y < end; y++) {
+    const Pixel *src = image_row(job->in, y);
+    Pixel *dst = image_row(job->out, y);
+    double fy = y * job->inv_s + GRID_PAD;
+    int iy = (int)fy;
+    double wy = fy - iy;
+
+    for (int x = 0; x < job->in.cols; x++) {
+      double fx = x * job->inv_s + GRID_PAD;
+      double fz = luma(src[x]) * job->inv_r + GRID_PAD;
+      int ix = (int)fx, iz = (int)fz;
+      double wx = fx - ix, wz = fz - iz;
+
+      double acc[4] = { 0.0, 0.0, 0.0, 0.0 };
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+          for (int dz = 0; dz < 2; dz++) {
+            double w = (dy ? wy : 1 - wy) * (dx ? wx : 1 - wx) * (dz ? wz : 1 - wz);
+            const float *c = job->grid + grid_cell(job, ix + dx, iy + dy, iz + dz);
+            for (int i = 0; i < 4; i++) {
+              acc[i] += w * c[i];
+            }
+          }
+        }
+      }
+
+      if (acc[3] <= 0.0) {
+        dst[x] = src[x];
+        continue;
+      }
+      int r = (int)(acc[0] / acc[3] + 0.5);
+      int g = (int)(acc[1] / acc[3] + 0.5);
+      int b = (int)(acc[2] / acc[3] + 0.5);
+      dst[x].r = r > 255 ? 255 : r;
+      dst[x].g = g > 255 ? 255 : g;
+      dst[x].b = b > 255 ? 255 : b;
     }
+  }
+}
 
-    //assign to output image data array
-    saturate_image.data[i].r = r_new;
-    saturate_image.data[i].b = b_new;
-    saturate_image.data[i].g = g_new;
+int bilateral_into(ImageContext *ctx, const Image in, Image out, double sigma_s, double sigma_r) {
+  if (!valid_image(in) || !valid_image(out) || !same_dims(in, out) || in.data == out.data
+      || !(sigma_s >= 1.0) || !(sigma_r >= 1.0)) {
+    return IM_ERR_ARGS;
   }
-  
-  return saturate_image;
+
+  GridJob job;
+  job.in = in;
+  job.out = out;
+  job.inv_s = 1.0 / sigma_s;
+  job.inv_r = 1.0 / sigma_r;
+  //room for the last cell's upper trilinear neighbour plus the blur's reach
+  job.gw = (int)((in.cols - 1) * job.inv_s) + 2 + 2 * GRID_PAD;
+  job.gh = (int)((in.rows - 1) * job.inv_s) + 2 + 2 * GRID_PAD;
+  job.gd = (int)(255 * job.inv_r) + 2 + 2 * GRID_PAD;
+
+  //checked one factor at a time, so the product cannot overflow
+  if ((size_t)job.gh > BILATERAL_MAX_CELLS / job.gd
+      || (size_t)job.gw > BILATERAL_MAX_CELLS / ((size_t)job.gh * job.gd)) {
+    return IM_ERR_ARGS;
+  }
+  size_t cells = (size_t)job.gw * job.gh * job.gd;
+  float *grid = scratch_get_n(ctx, cells, sizeof(float) * 4 * 2);
+  if (grid == NULL) {
+    return IM_ERR_NOMEM;
+  }
+  job.grid = grid;
+  job.tmp = grid + 4 * cells;
+
+  ThreadPool *pool = ctx_pool(ctx);
+  unsigned long long t0 = trace_now();
+  pool_rows(pool, job.gh, grid_splat_band, &job);
+  for (job.axis = 0; job.axis < 3; job.axis++) {
+    pool_rows(pool, job.gh, grid_blur_band, &job);
+    float *swap = job.grid;
+    job.grid = job.tmp;
+    job.tmp = swap;
+  }
+  pool_rows(pool, in.rows, grid_slice_band, &job);
+  trace_span("kernel", "bilateral", t0, -1);
+
+  scratch_release(ctx, grid);
+  return IM_OK;
+}
+
+Image bilateral(const Image in, double sigma_s, double sigma_r) {
+  Image out = make_image(in.rows, in.cols);
+
+  if (out.data != NULL && bilateral_into(NULL, in, out, sigma_s, sigma_r) != IM_OK) {
+    free_image(&out);
+  }
+
+  return out;
 }
 
 /*
@@ -222,13 +2186,13 @@ Function that creates the gauss_matrix to be used in the blur function.
 Takes in a sigma parameter. 
 */
 double* gauss_matrix(double sigma) {
-  int N = (double)(sigma * 10.0); 
-  if (N % 2 == 0) {
-    N += 1;
+  if (!(sigma > 0 && sigma <= BLUR_MAX_SIGMA)) {
+    return NULL;
   }
-  
+  int N = gauss_size(sigma);
+
   //mallocs a 2D matrix
-  double* g_matrix = malloc(N * N * sizeof(double));
+  double* g_matrix = malloc((size_t)N * N * sizeof(double));
     if (g_matrix == NULL) {
         fprintf(stderr, "Error: Memory allocation failed.\n");
         free(g_matrix);
@@ -247,7 +2211,7 @@ double* gauss_matrix(double sigma) {
       int dy = abs(i - N/2);
 
       //calculate and assign value
-      g_matrix[i * N + j] = (1.0 / (2.0 * pi * (sigma * sigma))) * exp( -((dx * dx) + (dy * dy)) / (2 * (sigma * sigma)));
+      g_matrix[(size_t)i * N + j] = (1.0 / (2.0 * pi * (sigma * sigma))) * exp( -((dx * dx) + (dy * dy)) / (2 * (sigma * sigma)));
     }
   }
   
@@ -255,150 +2219,82 @@ double* gauss_matrix(double sigma) {
 }
 
 /*
-Applies the gauss matrix created in the g_matrix function to the image.
-takes in the filter, the original image and the new image as parameters
+width of the gauss matrix for sigma: ten sigma, rounded up to odd
 */
-Image apply_filter (double* g_filter, Image im1, Image im2, double sigma) {
-  int N = (int)(sigma * 10.0); 
+static int gauss_size(double sigma) {
+  int N = (int)(sigma * 10.0);
   if (N % 2 == 0) {
     N += 1;
   }
-
-  //initialize output image to black
-  for (int i = 0; i < im1.cols * im1.rows; i++) {
-    im2.data[i].r = 0;
-    im2.data[i].g = 0;
-    im2.data[i].b = 0;
-  }
-    int center = N / 2;
-
-    //iterate through pixels in image
-  for (int y = 0; y < im1.rows; y++) {
-    for (int x = 0; x < im1.cols; x++) {
-	  //initialize running sums for rgb values and normalizing sum
-	      double r_sum = 0.0;
-        double g_sum = 0.0;
-        double b_sum = 0.0;
-        double norm = 0.0;
-	    //iterate through pixels around the given pixel 
-	    for (int i = -center; i <= center; i++) {
-        for (int j = -center; j <= center; j++) {
-          int yy = y + i;
-          int xx = x + j;
-
-		    //check that it is not indexing outside the edges of the image
-		      if (yy >= 0 && yy < im1.rows && xx >= 0 && xx < im1.cols) {
-            int pos = yy * im1.cols + xx;
-            r_sum += im1.data[pos].r * g_filter[(i + center) * N + (j + center)];
-            g_sum += im1.data[pos].g * g_filter[(i + center) * N + (j + center)];
-            b_sum += im1.data[pos].b * g_filter[(i + center) * N + (j + center)];
-            norm += g_filter[(i + center) * N + (j + center)];
-          } else {
-		        continue;
-          }
-        }
-      }
-
-	    //normalize the sums
-        double r = r_sum / norm;
-        double g = g_sum / norm;
-        double b = b_sum / norm;
-
-	    //index into output image
-        im2.data[y * im1.cols + x].r = (unsigned char)r;
-        im2.data[y * im1.cols + x].g = (unsigned char)g;
-        im2.data[y * im1.cols + x].b = (unsigned char)b;
-    }
-  }
-    
-    
-    return im2;
+  return N;
 }
 
-// handler for case in blend where image 1 is strictly a subset of image 2
-Image handleCase1(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
-  if (in1.rows < in2.rows && in1.cols < in2.cols) {
+// handler for case in blend where image 1 is a subset of image 2
+// (including when they share a width or a height)
+static void handleCase1(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
+  if (in1.rows <= in2.rows && in1.cols <= in2.cols) {
       for (int i = 0; i < max_rows; i++) {
 	      for (int j = min_cols; j < max_cols; j++) {
-	        blend_image.data[i * max_cols + j].r = in2.data[i * max_cols + j].r;
-	        blend_image.data[i * max_cols + j].g = in2.data[i * max_cols + j].g;
-	        blend_image.data[i * max_cols + j].b = in2.data[i * max_cols + j].b;
+	        image_row(blend_image, i)[j] = image_row(in2, i)[j];
 	      }
       }
 
       for (int i = min_rows; i < max_rows; i++) {
 	      for (int j = 0; j < min_cols; j++) {
-	        blend_image.data[i * max_cols + j].r = in2.data[i * max_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in2.data[i * max_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in2.data[i * max_cols + j].b;
+	        image_row(blend_image, i)[j] = image_row(in2, i)[j];
 	      }
       }
     }
-    return blend_image; 
 }
 
-//handler for case in blend where image 2 is strictly a subset of image 1
-Image handleCase2(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
-  if (in2.rows < in1.rows && in2.cols < in1.cols) {
+//handler for case in blend where image 2 is a subset of image 1
+//(including when they share a width or a height)
+static void handleCase2(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
+  if (in2.rows <= in1.rows && in2.cols <= in1.cols) {
       for (int i = 0; i < max_rows; i++) {
         for (int j = min_cols; j < max_cols; j++) {
-          blend_image.data[i * max_cols + j].r = in1.data[i * max_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in1.data[i * max_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in1.data[i * max_cols + j].b;
+          image_row(blend_image, i)[j] = image_row(in1, i)[j];
 	      }
       }
 
       for (int i = min_rows; i < max_rows; i++)	{
         for (int j = 0; j < min_cols; j++) {
-          blend_image.data[i * max_cols + j].r = in1.data[i * max_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in1.data[i * max_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in1.data[i * max_cols + j].b;
+          image_row(blend_image, i)[j] = image_row(in1, i)[j];
         }
       }
     }
-    return blend_image;
 }
 
 // handler for blend case when image 2 is longer vertically than image 1 and image 1 is longer horizontally         
-Image handleCase3(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
+static void handleCase3(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
   if (in1.rows < in2.rows && in1.cols > in2.cols) {
       for (int i = 0; i < min_rows; i++) {
 	      for (int j = min_cols; j < max_cols; j++) {
-	        blend_image.data[i * max_cols + j].r = in1.data[i * max_cols + j].r;
-	        blend_image.data[i * max_cols + j].g = in1.data[i * max_cols + j].g;
-	        blend_image.data[i * max_cols + j].b = in1.data[i * max_cols + j].b;
+	        image_row(blend_image, i)[j] = image_row(in1, i)[j];
 	      }
       }
 
       for (int i = min_rows; i < max_rows; i++) {
 	      for (int j = 0; j < min_cols; j++) {
-	        blend_image.data[i * max_cols + j].r = in2.data[i * min_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in2.data[i * min_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in2.data[i * min_cols + j].b;
+	        image_row(blend_image, i)[j] = image_row(in2, i)[j];
 	      }
       }
     }
-    return blend_image; 
 }
 
 // handler for blend case when image 1 is longer vertically than image 2 and image 2 is longer horizontally     
-Image handleCase4(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
+static void handleCase4(Image in1, Image in2, Image blend_image, int max_cols, int min_cols, int min_rows, int max_rows) {
   if (in1.rows > in2.rows && in1.cols < in2.cols) {
       for (int i = 0; i < min_rows; i++) {
         for (int j = min_cols; j < max_cols; j++) {
-          blend_image.data[i * max_cols + j].r = in2.data[i * max_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in2.data[i * max_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in2.data[i * max_cols + j].b;
+          image_row(blend_image, i)[j] = image_row(in2, i)[j];
         }
       }
 
       for (int i = min_rows; i < max_rows; i++) {
         for (int j = 0; j < min_cols; j++) {
-          blend_image.data[i * max_cols + j].r = in1.data[i * min_cols + j].r;
-          blend_image.data[i * max_cols + j].g = in1.data[i * min_cols + j].g;
-          blend_image.data[i * max_cols + j].b = in1.data[i * min_cols + j].b;
+          image_row(blend_image, i)[j] = image_row(in1, i)[j];
         }
       }
     }
-    return blend_image; 
 }
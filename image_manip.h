@@ -3,6 +3,10 @@
 
 #include "ppm_io.h"
 
+#ifdef __cplusplus
+extern "C" {
+#endif
+
 
 //////////////////////////////////
 // Image manipulation functions //
@@ -10,7 +14,9 @@
 
 //______grayscale______
 /* convert an image to grayscale (NOTE: pixels are still
-* RGB, but the three values will be equal)
+* RGB, but the three values will be equal); the "grayscale" color matrix,
+* so 0.3 r + 0.59 g + 0.11 b is rounded in fixed point, where the
+* original float version truncated (results can be one level higher)
 */
 Image grayscale( const Image in );
 
@@ -30,13 +36,241 @@ Image rotate_ccw( const Image in );
 Image pointilism( const Image in);
 
 //______blur______
-/* apply a blurring filter to the image
+/* apply a blurring filter to the image; sigma may be at most
+* BLUR_MAX_SIGMA (the kernel is 10 sigma wide)
 */
+#define BLUR_MAX_SIGMA 256
+
 Image blur( const Image in , double sigma );
 
 //______saturate______
-/* Saturate the image by scaling the deviation from gray
+/* Saturate the image by scaling the deviation from gray;
+* the color matrix from saturate_matrix(), rounded in fixed point. The
+* original float version truncated the gray level before scaling, so
+* its results differ by up to about the scale itself
 */
 Image saturate( const Image in , double scale );
 
+//______color matrix______
+/* affine color transform: output channel c (0 = red, 1 = green,
+* 2 = blue) is m[4c] * r + m[4c+1] * g + m[4c+2] * b + m[4c+3], rounded
+* and clamped to 0-255. Coefficients are applied in fixed point with up
+* to 12 fractional bits (fewer once a coefficient exceeds 8), and must lie
+* within +-COLOR_MATRIX_MAX; offsets within +-COLOR_MATRIX_MAX_OFFSET
+*/
+#define COLOR_MATRIX_MAX 4096
+#define COLOR_MATRIX_MAX_OFFSET 65536
+
+Image color_matrix( const Image in , const double m[12] );
+
+/* look up a named matrix: grayscale, sepia, invert, bgr;
+* returns 0, or -1 if unknown
+*/
+int color_matrix_preset( const char * name , double m[12] );
+
+/* the matrix saturate() applies: scale * identity + (1 - scale) * gray */
+void saturate_matrix( double scale , double m[12] );
+
+//______stats______
+/* histograms and summary statistics gathered in one parallel pass;
+* channel index 0 = red, 1 = green, 2 = blue, 3 = luma (grayscale weights)
+*/
+#define STAT_CHANNELS 4
+#define STAT_LUMA 3
+
+typedef struct {
+  unsigned long long hist[STAT_CHANNELS][256];
+  unsigned long long count;
+  int min[STAT_CHANNELS];
+  int max[STAT_CHANNELS];
+  double mean[STAT_CHANNELS];
+} ImageStats;
+
+ImageStats image_stats( const Image in );
+
+/* smallest value v such that at least pct percent of the
+* samples of the given channel are <= v
+*/
+int stats_percentile( const ImageStats * st , int channel , double pct );
+
+//______auto-levels______
+/* stretch each channel so that its low_pct percentile maps to 0
+* and its high_pct percentile maps to 255
+*/
+Image auto_levels( const Image in , double low_pct , double high_pct );
+
+//______convolve______
+/* integer convolution kernel: size x size taps in row-major order;
+* each output is sum(taps * pixels) / divisor + bias, clamped to 0-255
+*/
+typedef struct {
+  int *weights;
+  int size;
+  int divisor;
+  int bias;
+} Kernel;
+
+/* allocate a zeroed kernel with divisor 1 and bias 0 (size must be odd) */
+Kernel make_kernel( int size );
+
+/* release the taps of a kernel and set them to null */
+void free_kernel( Kernel * k );
+
+/* look up a named kernel: sharpen, sobel-x, sobel-y, emboss,
+* laplacian, box, gaussian5; returns a kernel with null weights if unknown
+*/
+Kernel kernel_preset( const char * name );
+
+/* read a kernel from a text file: the size (odd, at most
+* KERNEL_MAX_SIZE), then size*size integer taps, then optionally the
+* divisor and bias; the divisor defaults to the sum of the taps (or 1
+* unless that is positive). 255 times the absolute sum of the taps must
+* fit an int, the divisor must be positive and the bias within
+* +-KERNEL_MAX_BIAS. Null weights on error.
+*/
+#define KERNEL_MAX_SIZE 63
+#define KERNEL_MAX_BIAS 65536
+
+Kernel read_kernel( FILE * fp );
+
+/* convolve the image with the kernel, replicating edge pixels
+* outside the image
+*/
+Image convolve( const Image in , const Kernel * k );
+
+//______affine warp______
+/* m is a 2x3 matrix mapping input coordinates to output coordinates:
+* x' = m[0] x + m[1] y + m[2] and y' = m[3] x + m[4] y + m[5], with pixel
+* (x, y) covering [x, x+1) x [y, y+1). The output has the input's size;
+* output pixels that map outside the input are black. With bilinear set
+* the input is sampled bilinearly, otherwise the nearest pixel is used.
+*/
+Image affine( const Image in , const double m[6] , int bilinear );
+
+//______rotate______
+/* rotate the image counter-clockwise by any angle about its center,
+* keeping the input's size
+*/
+Image rotate( const Image in , double degrees , int bilinear );
+
+/* affine matrix for rotating an in_cols x in_rows image counter-clockwise
+* about its center onto the center of an out_cols x out_rows image
+*/
+void rotation_matrix( int in_rows , int in_cols , int out_rows , int out_cols , double degrees , double m[6] );
+
+//______median______
+#define MEDIAN_MAX_RADIUS 255
+
+/* replace every pixel, per channel, by the median of the
+* (2 radius + 1) x (2 radius + 1) square around it, replicating edge
+* pixels outside the image; the cost does not grow with the radius
+*/
+Image median( const Image in , int radius );
+
+//______unsharp______
+/* sharpen with an unsharp mask: where a channel differs from the
+* blurred image (blur with sigma) by at least threshold, the difference
+* is added back scaled by amount
+*/
+Image unsharp( const Image in , double sigma , double amount , int threshold );
+
+//______stack______
+#define STACK_MAX_IMAGES 65535
+
+typedef enum {
+  STACK_MEAN ,
+  STACK_MEDIAN ,  // an even count averages the two middle values
+  STACK_MAX ,
+  STACK_MIN
+} StackMode;
+
+/* combine n images of the same size channel by channel. The inputs can
+* be the same few rows of every image, so a long stack can be streamed
+* through stack_into a slice at a time (see read_ppm_rows)
+*/
+Image stack( const Image * in , int n , StackMode mode );
+
+//______morphology______
+#define MORPH_MAX_SIZE 1023
+
+typedef enum {
+  MORPH_ERODE ,   // minimum over the rectangle
+  MORPH_DILATE ,  // maximum over the rectangle
+  MORPH_OPEN ,    // erode, then dilate
+  MORPH_CLOSE     // dilate, then erode
+} MorphOp;
+
+/* apply op per channel with a width x height rectangle whose anchor is
+* (width / 2, height / 2), replicating edge pixels outside the image;
+* the cost per pixel does not depend on the rectangle's size
+*/
+Image morph( const Image in , MorphOp op , int width , int height );
+
+//______bilateral______
+/* edge-preserving smoothing: a Gaussian of sigma_s pixels that only
+* mixes pixels whose luma differs by about sigma_r or less. Approximated
+* on a bilateral grid with cells of sigma_s x sigma_s pixels x sigma_r
+* luma levels, so both sigmas must be at least 1 and the grid takes
+* 32 bytes per cell. At most BILATERAL_MAX_CELLS cells (1 GB) are used;
+* beyond that bilateral_into returns IM_ERR_ARGS, and a larger image
+* needs larger sigmas
+*/
+#define BILATERAL_MAX_CELLS ((size_t)1 << 25)
+
+Image bilateral( const Image in , double sigma_s , double sigma_r );
+
+
+///////////////////////////////////////////
+// Allocation-free versions of the above //
+///////////////////////////////////////////
+
+/* The _into functions write into a caller-provided out image, which
+* may be a padded buffer (stride > cols) and must not overlap the input.
+* Its size must match what the allocating version would have returned.
+* They return one of the codes below instead of a null image.
+*/
+#define IM_OK         0
+#define IM_ERR_ARGS   1  // null data, bad stride or wrong output size
+#define IM_ERR_NOMEM  2  // scratch memory could not be allocated
+
+/* reusable state for the _into functions: a thread pool, scratch
+* buffers and cached blur kernels. Once warmed up, calls that reuse the
+* same context do not allocate. A context must not be used by two calls
+* at the same time; passing NULL uses the shared default pool and
+* allocates scratch per call.
+*/
+typedef struct ImageContext ImageContext;
+
+/* nthreads <= 0 shares the process-wide default pool */
+ImageContext * context_create( int nthreads );
+void context_destroy( ImageContext * ctx );
+/* threads the context's pool runs on (the default pool's for NULL) */
+int context_threads( ImageContext * ctx );
+
+int grayscale_into( ImageContext * ctx , const Image in , Image out );
+int blend_into( ImageContext * ctx , const Image in1 , const Image in2 , Image out , double alpha );
+int rotate_ccw_into( ImageContext * ctx , const Image in , Image out );
+int pointilism_into( ImageContext * ctx , const Image in , Image out );
+int blur_into( ImageContext * ctx , const Image in , Image out , double sigma );
+int saturate_into( ImageContext * ctx , const Image in , Image out , double scale );
+/* IM_ERR_ARGS if m is out of range; in and out may be the same image */
+int color_matrix_into( ImageContext * ctx , const Image in , Image out , const double m[12] );
+int image_stats_into( ImageContext * ctx , const Image in , ImageStats * st );
+int auto_levels_into( ImageContext * ctx , const Image in , Image out , double low_pct , double high_pct );
+/* IM_ERR_ARGS unless the size is odd and the divisor positive; the taps
+* must obey the read_kernel() bound or the sums overflow */
+int convolve_into( ImageContext * ctx , const Image in , Image out , const Kernel * k );
+/* out may have any size; IM_ERR_ARGS if m is not invertible */
+int affine_into( ImageContext * ctx , const Image in , Image out , const double m[6] , int bilinear );
+int rotate_into( ImageContext * ctx , const Image in , Image out , double degrees , int bilinear );
+int median_into( ImageContext * ctx , const Image in , Image out , int radius );
+int unsharp_into( ImageContext * ctx , const Image in , Image out , double sigma , double amount , int threshold );
+int stack_into( ImageContext * ctx , const Image * in , int n , Image out , StackMode mode );
+int morph_into( ImageContext * ctx , const Image in , Image out , MorphOp op , int width , int height );
+int bilateral_into( ImageContext * ctx , const Image in , Image out , double sigma_s , double sigma_r );
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
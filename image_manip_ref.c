@@ -0,0 +1,639 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include "image_manip_ref.h"
+#include "ppm_io.h"
+
+/* shorthand for the pixel at row y, column x */
+#define PIX(im, y, x) (image_row((im), (y))[(x)])
+
+static unsigned char clamp_255(int v) {
+  if (v > 255) {
+    return 255;
+  } else if (v < 0) {
+    return 0;
+  }
+  return (unsigned char)v;
+}
+
+/*
+same fixed point model as color_matrix(): coefficients quantized with
+the most fractional bits (up to 12) that keep them in an int16
+*/
+Image color_matrix_ref(const Image in, const double m[12]) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  int shift = 12;
+  for (int i = 0; i < 12; i++) {
+    while (i % 4 != 3 && fabs(m[i]) * (1 << shift) > 32767.0) {
+      shift--;
+    }
+  }
+  long q[12];
+  for (int i = 0; i < 12; i++) {
+    q[i] = lround(m[i] * (1 << shift));
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel p = PIX(in, y, x);
+      int v[3];
+      for (int c = 0; c < 3; c++) {
+        long sum = q[4 * c] * p.r + q[4 * c + 1] * p.g + q[4 * c + 2] * p.b + q[4 * c + 3];
+        //round half up, then clamp
+        if (shift > 0) {
+          sum += 1L << (shift - 1);
+        }
+        v[c] = sum < 0 ? 0 : (int)(sum >> shift);
+      }
+      PIX(out, y, x).r = clamp_255(v[0]);
+      PIX(out, y, x).g = clamp_255(v[1]);
+      PIX(out, y, x).b = clamp_255(v[2]);
+    }
+  }
+  return out;
+}
+
+Image grayscale_ref(const Image in) {
+  double m[12];
+  color_matrix_preset("grayscale", m);
+  return color_matrix_ref(in, m);
+}
+
+Image blend_ref(const Image in1, const Image in2, double alpha) {
+  int rows = in1.rows > in2.rows ? in1.rows : in2.rows;
+  int cols = in1.cols > in2.cols ? in1.cols : in2.cols;
+  Image out = make_image(rows, cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  //each pixel comes from whichever images cover it, else black
+  for (int y = 0; y < rows; y++) {
+    for (int x = 0; x < cols; x++) {
+      int in_1 = y < in1.rows && x < in1.cols;
+      int in_2 = y < in2.rows && x < in2.cols;
+      Pixel p = { 0, 0, 0 };
+
+      if (in_1 && in_2) {
+        Pixel a = PIX(in1, y, x);
+        Pixel b = PIX(in2, y, x);
+        p.r = (int)((double)a.r * alpha + (double)b.r * (1 - alpha));
+        p.g = (int)((double)a.g * alpha + (double)b.g * (1 - alpha));
+        p.b = (int)((double)a.b * alpha + (double)b.b * (1 - alpha));
+      } else if (in_1) {
+        p = PIX(in1, y, x);
+      } else if (in_2) {
+        p = PIX(in2, y, x);
+      }
+      PIX(out, y, x) = p;
+    }
+  }
+  return out;
+}
+
+Image rotate_ccw_ref(const Image in) {
+  Image out = make_image(in.cols, in.rows);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      PIX(out, in.cols - x - 1, y) = PIX(in, y, x);
+    }
+  }
+  return out;
+}
+
+Image pointilism_ref(const Image in) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      PIX(out, y, x).r = 0;
+      PIX(out, y, x).g = 0;
+      PIX(out, y, x).b = 0;
+    }
+  }
+
+  size_t num_pix = (size_t)in.rows * in.cols;
+  for (size_t k = 0; k < (num_pix * 0.03); k++) {
+    int rand_col = rand() % (in.cols);
+    int rand_row = rand() % (in.rows);
+    int radius = rand() % 5 + 1;
+    Pixel p = PIX(in, rand_row, rand_col);
+
+    for (int i = -radius; i <= radius; i++) {
+      for (int j = -radius; j <= radius; j++) {
+        int y = rand_row + i;
+        int x = rand_col + j;
+        if (i * i + j * j <= radius * radius && y >= 0 && y < in.rows && x >= 0 && x < in.cols) {
+          PIX(out, y, x) = p;
+        }
+      }
+    }
+  }
+  return out;
+}
+
+Image blur_ref(const Image in, double sigma) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  int N = (int)(sigma * 10.0);
+  if (N % 2 == 0) {
+    N += 1;
+  }
+  int center = N / 2;
+  double pi = 3.14159265358979323846;
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      double r_sum = 0.0, g_sum = 0.0, b_sum = 0.0, norm = 0.0;
+
+      for (int i = -center; i <= center; i++) {
+        for (int j = -center; j <= center; j++) {
+          int yy = y + i;
+          int xx = x + j;
+          if (yy < 0 || yy >= in.rows || xx < 0 || xx >= in.cols) {
+            continue;
+          }
+          int dx = abs(j);
+          int dy = abs(i);
+          double w = (1.0 / (2.0 * pi * (sigma * sigma))) * exp( -((dx * dx) + (dy * dy)) / (2 * (sigma * sigma)));
+          r_sum += PIX(in, yy, xx).r * w;
+          g_sum += PIX(in, yy, xx).g * w;
+          b_sum += PIX(in, yy, xx).b * w;
+          norm += w;
+        }
+      }
+
+      PIX(out, y, x).r = (unsigned char)(r_sum / norm);
+      PIX(out, y, x).g = (unsigned char)(g_sum / norm);
+      PIX(out, y, x).b = (unsigned char)(b_sum / norm);
+    }
+  }
+  return out;
+}
+
+Image saturate_ref(const Image in, double scale) {
+  double m[12];
+  saturate_matrix(scale, m);
+  return color_matrix_ref(in, m);
+}
+
+/*
+smallest value v such that at least pct percent of the samples are <= v
+*/
+static int percentile_ref(const unsigned long long *hist, unsigned long long count, double pct) {
+  unsigned long long seen = 0;
+  for (int v = 0; v < 256; v++) {
+    seen += hist[v];
+    if (seen > 0 && seen >= count * (pct / 100.0)) {
+      return v;
+    }
+  }
+  return 255;
+}
+
+static unsigned char level_ref(int v, int lo, int hi) {
+  if (hi <= lo) {
+    return v;
+  }
+  return clamp_255((v - lo) * 255 / (hi - lo));
+}
+
+Image auto_levels_ref(const Image in, double low_pct, double high_pct) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  unsigned long long hist[3][256] = { { 0 } };
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      hist[0][PIX(in, y, x).r]++;
+      hist[1][PIX(in, y, x).g]++;
+      hist[2][PIX(in, y, x).b]++;
+    }
+  }
+
+  unsigned long long count = (unsigned long long)in.rows * in.cols;
+  int lo[3], hi[3];
+  for (int c = 0; c < 3; c++) {
+    lo[c] = percentile_ref(hist[c], count, low_pct);
+    hi[c] = percentile_ref(hist[c], count, high_pct);
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel p = PIX(in, y, x);
+      PIX(out, y, x).r = level_ref(p.r, lo[0], hi[0]);
+      PIX(out, y, x).g = level_ref(p.g, lo[1], hi[1]);
+      PIX(out, y, x).b = level_ref(p.b, lo[2], hi[2]);
+    }
+  }
+  return out;
+}
+
+Image convolve_ref(const Image in, const Kernel *k) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  int n = k->size;
+  int center = n / 2;
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      int r = 0, g = 0, b = 0;
+
+      for (int i = 0; i < n; i++) {
+        for (int j = 0; j < n; j++) {
+          //replicate the edge pixels outside the image
+          int yy = y + i - center;
+          int xx = x + j - center;
+          yy = yy < 0 ? 0 : (yy >= in.rows ? in.rows - 1 : yy);
+          xx = xx < 0 ? 0 : (xx >= in.cols ? in.cols - 1 : xx);
+
+          int w = k->weights[i * n + j];
+          r += w * PIX(in, yy, xx).r;
+          g += w * PIX(in, yy, xx).g;
+          b += w * PIX(in, yy, xx).b;
+        }
+      }
+
+      PIX(out, y, x).r = clamp_255(r / k->divisor + k->bias);
+      PIX(out, y, x).g = clamp_255(g / k->divisor + k->bias);
+      PIX(out, y, x).b = clamp_255(b / k->divisor + k->bias);
+    }
+  }
+  return out;
+}
+
+Image median_ref(const Image in, int radius) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  int n = (2 * radius + 1) * (2 * radius + 1);
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      int count[3][256] = { { 0 } };
+      for (int i = -radius; i <= radius; i++) {
+        for (int j = -radius; j <= radius; j++) {
+          //replicate the edge pixels outside the image
+          int yy = y + i;
+          int xx = x + j;
+          yy = yy < 0 ? 0 : (yy >= in.rows ? in.rows - 1 : yy);
+          xx = xx < 0 ? 0 : (xx >= in.cols ? in.cols - 1 : xx);
+          count[0][PIX(in, yy, xx).r]++;
+          count[1][PIX(in, yy, xx).g]++;
+          count[2][PIX(in, yy, xx).b]++;
+        }
+      }
+
+      unsigned char med[3];
+      for (int c = 0; c < 3; c++) {
+        int seen = 0, v = 0;
+        while (seen + count[c][v] <= n / 2) {
+          seen += count[c][v++];
+        }
+        med[c] = v;
+      }
+      PIX(out, y, x).r = med[0];
+      PIX(out, y, x).g = med[1];
+      PIX(out, y, x).b = med[2];
+    }
+  }
+  return out;
+}
+
+static unsigned char unsharp_ref_value(int orig, int blurred, double amount, int threshold) {
+  int diff = orig - blurred;
+  if (abs(diff) < threshold) {
+    return orig;
+  }
+  return clamp_255((int)floor(orig + amount * diff + 0.5));
+}
+
+Image unsharp_ref(const Image in, double sigma, double amount, int threshold) {
+  Image blurred = blur_ref(in, sigma);
+  if (blurred.data == NULL) {
+    return blurred;
+  }
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    free_image(&blurred);
+    return out;
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel p = PIX(in, y, x);
+      Pixel b = PIX(blurred, y, x);
+      PIX(out, y, x).r = unsharp_ref_value(p.r, b.r, amount, threshold);
+      PIX(out, y, x).g = unsharp_ref_value(p.g, b.g, amount, threshold);
+      PIX(out, y, x).b = unsharp_ref_value(p.b, b.b, amount, threshold);
+    }
+  }
+  free_image(&blurred);
+  return out;
+}
+
+/* minimum (or maximum) over the rectangle around every pixel */
+static Image extreme_ref(const Image in, int width, int height, int use_max) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel best = PIX(in, y, x);
+      for (int i = 0; i < height; i++) {
+        for (int j = 0; j < width; j++) {
+          //replicate the edge pixels outside the image
+          int yy = y - height / 2 + i;
+          int xx = x - width / 2 + j;
+          yy = yy < 0 ? 0 : (yy >= in.rows ? in.rows - 1 : yy);
+          xx = xx < 0 ? 0 : (xx >= in.cols ? in.cols - 1 : xx);
+          Pixel p = PIX(in, yy, xx);
+          if (use_max) {
+            best.r = p.r > best.r ? p.r : best.r;
+            best.g = p.g > best.g ? p.g : best.g;
+            best.b = p.b > best.b ? p.b : best.b;
+          } else {
+            best.r = p.r < best.r ? p.r : best.r;
+            best.g = p.g < best.g ? p.g : best.g;
+            best.b = p.b < best.b ? p.b : best.b;
+          }
+        }
+      }
+      PIX(out, y, x) = best;
+    }
+  }
+  return out;
+}
+
+Image morph_ref(const Image in, MorphOp op, int width, int height) {
+  if (op == MORPH_ERODE || op == MORPH_DILATE) {
+    return extreme_ref(in, width, height, op == MORPH_DILATE);
+  }
+
+  Image first = extreme_ref(in, width, height, op == MORPH_CLOSE);
+  if (first.data == NULL) {
+    return first;
+  }
+  Image out = extreme_ref(first, width, height, op == MORPH_OPEN);
+  free_image(&first);
+  return out;
+}
+
+static int compare_bytes(const void *a, const void *b) {
+  return *(const unsigned char *)a - *(const unsigned char *)b;
+}
+
+Image stack_ref(const Image *in, int n, StackMode mode) {
+  Image out = make_image(in[0].rows, in[0].cols);
+  unsigned char *v = malloc(n);
+  if (out.data == NULL || v == NULL) {
+    free(v);
+    free_image(&out);
+    return out;
+  }
+
+  for (int y = 0; y < out.rows; y++) {
+    for (int x = 0; x < out.cols; x++) {
+      for (int c = 0; c < 3; c++) {
+        for (int i = 0; i < n; i++) {
+          v[i] = (&PIX(in[i], y, x).r)[c];
+        }
+        qsort(v, n, 1, compare_bytes);
+
+        int result;
+        if (mode == STACK_MEAN) {
+          long sum = 0;
+          for (int i = 0; i < n; i++) {
+            sum += v[i];
+          }
+          result = (sum + n / 2) / n;
+        } else if (mode == STACK_MEDIAN) {
+          result = (v[(n - 1) / 2] + v[n / 2] + 1) / 2;
+        } else if (mode == STACK_MAX) {
+          result = v[n - 1];
+        } else {
+          result = v[0];
+        }
+        (&PIX(out, y, x).r)[c] = result;
+      }
+    }
+  }
+  free(v);
+  return out;
+}
+
+/*
+same bilateral grid as bilateral(), built serially: splat to the nearest
+cell, [1 4 6 4 1] / 16 along x, y and luma, trilinear slice
+*/
+Image bilateral_ref(const Image in, double sigma_s, double sigma_r) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  const int pad = 2;
+  double inv_s = 1.0 / sigma_s, inv_r = 1.0 / sigma_r;
+  int dims[3];
+  dims[0] = (int)((in.cols - 1) * inv_s) + 2 + 2 * pad;
+  dims[1] = (int)((in.rows - 1) * inv_s) + 2 + 2 * pad;
+  dims[2] = (int)(255 * inv_r) + 2 + 2 * pad;
+  size_t cells = (size_t)dims[0] * dims[1] * dims[2];
+  float *grid = calloc(cells * 4, sizeof(float));
+  float *tmp = malloc(cells * 4 * sizeof(float));
+  if (grid == NULL || tmp == NULL) {
+    free(grid);
+    free(tmp);
+    free_image(&out);
+    return out;
+  }
+#define CELL(x, y, z) ((((size_t)(y) * dims[0] + (x)) * dims[2] + (z)) * 4)
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel p = PIX(in, y, x);
+      int l = (30 * p.r + 59 * p.g + 11 * p.b) / 100;
+      float *c = grid + CELL((int)(x * inv_s + 0.5) + pad, (int)(y * inv_s + 0.5) + pad,
+                             (int)(l * inv_r + 0.5) + pad);
+      c[0] += p.r;
+      c[1] += p.g;
+      c[2] += p.b;
+      c[3] += 1.0f;
+    }
+  }
+
+  static const float taps[5] = { 1.0f / 16, 4.0f / 16, 6.0f / 16, 4.0f / 16, 1.0f / 16 };
+  for (int axis = 0; axis < 3; axis++) {
+    for (int gy = 0; gy < dims[1]; gy++) {
+      for (int gx = 0; gx < dims[0]; gx++) {
+        for (int gz = 0; gz < dims[2]; gz++) {
+          int pos[3] = { gx, gy, gz };
+          float sum[4] = { 0.0f, 0.0f, 0.0f, 0.0f };
+          for (int t = -2; t <= 2; t++) {
+            int q[3] = { gx, gy, gz };
+            q[axis] += t;
+            if (pos[axis] + t < 0 || pos[axis] + t >= dims[axis]) {
+              continue;
+            }
+            for (int i = 0; i < 4; i++) {
+              sum[i] += taps[t + 2] * grid[CELL(q[0], q[1], q[2]) + i];
+            }
+          }
+          memcpy(tmp + CELL(gx, gy, gz), sum, sizeof(sum));
+        }
+      }
+    }
+    float *swap = grid;
+    grid = tmp;
+    tmp = swap;
+  }
+
+  for (int y = 0; y < in.rows; y++) {
+    for (int x = 0; x < in.cols; x++) {
+      Pixel p = PIX(in, y, x);
+      int l = (30 * p.r + 59 * p.g + 11 * p.b) / 100;
+      double f[3] = { x * inv_s + pad, y * inv_s + pad, l * inv_r + pad };
+      int ix = (int)f[0], iy = (int)f[1], iz = (int)f[2];
+      double wx = f[0] - ix, wy = f[1] - iy, wz = f[2] - iz;
+
+      double acc[4] = { 0.0, 0.0, 0.0, 0.0 };
+      for (int dy = 0; dy < 2; dy++) {
+        for (int dx = 0; dx < 2; dx++) {
+          for (int dz = 0; dz < 2; dz++) {
+            double w = (dy ? wy : 1 - wy) * (dx ? wx : 1 - wx) * (dz ? wz : 1 - wz);
+            for (int i = 0; i < 4; i++) {
+              acc[i] += w * grid[CELL(ix + dx, iy + dy, iz + dz) + i];
+            }
+          }
+        }
+      }
+
+      if (acc[3] <= 0.0) {
+        PIX(out, y, x) = p;
+        continue;
+      }
+      PIX(out, y, x).r = clamp_255((int)(acc[0] / acc[3] + 0.5));
+      PIX(out, y, x).g = clamp_255((int)(acc[1] / acc[3] + 0.5));
+      PIX(out, y, x).b = clamp_255((int)(acc[2] / acc[3] + 0.5));
+    }
+  }
+#undef CELL
+
+  free(grid);
+  free(tmp);
+  return out;
+}
+
+/*
+same fixed point model as affine(): the inverse matrix is quantized to
+24 fractional bits, but every source coordinate is computed directly
+*/
+Image affine_ref(const Image in, const double m[6], int bilinear) {
+  Image out = make_image(in.rows, in.cols);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  double det = m[0] * m[4] - m[1] * m[3];
+  if (!(fabs(det) > 1e-12)) {
+    free_image(&out);
+    return out;
+  }
+  double ia = m[4] / det, ib = -m[1] / det, ic = -(ia * m[2] + ib * m[5]);
+  double id = -m[3] / det, ie = m[0] / det, jf = -(id * m[2] + ie * m[5]);
+
+  const long long one = 1LL << 24;
+  long long a = llround(ia * one), b = llround(ib * one), c = llround((ia * 0.5 + ib * 0.5 + ic) * one);
+  long long d = llround(id * one), e = llround(ie * one), f = llround((id * 0.5 + ie * 0.5 + jf) * one);
+
+  for (int y = 0; y < out.rows; y++) {
+    for (int x = 0; x < out.cols; x++) {
+      long long u = a * x + b * y + c;
+      long long v = d * x + e * y + f;
+      Pixel p = { 0, 0, 0 };
+
+      if (u >= 0 && v >= 0 && u < in.cols * one && v < in.rows * one) {
+        if (!bilinear) {
+          p = PIX(in, (int)(v / one), (int)(u / one));
+        } else {
+          //neighbours around the point half a pixel up and to the left
+          long long su = u - one / 2, sv = v - one / 2;
+          int x0 = su < 0 ? -1 : (int)(su / one);
+          int y0 = sv < 0 ? -1 : (int)(sv / one);
+          int wx = (int)((su - x0 * one) / (one / 256));
+          int wy = (int)((sv - y0 * one) / (one / 256));
+          int x1 = x0 + 1 >= in.cols ? in.cols - 1 : x0 + 1;
+          int y1 = y0 + 1 >= in.rows ? in.rows - 1 : y0 + 1;
+          x0 = x0 < 0 ? 0 : x0;
+          y0 = y0 < 0 ? 0 : y0;
+
+          Pixel p00 = PIX(in, y0, x0), p01 = PIX(in, y0, x1);
+          Pixel p10 = PIX(in, y1, x0), p11 = PIX(in, y1, x1);
+          p.r = (p00.r * (256 - wx) * (256 - wy) + p01.r * wx * (256 - wy)
+                 + p10.r * (256 - wx) * wy + p11.r * wx * wy + 32768) >> 16;
+          p.g = (p00.g * (256 - wx) * (256 - wy) + p01.g * wx * (256 - wy)
+                 + p10.g * (256 - wx) * wy + p11.g * wx * wy + 32768) >> 16;
+          p.b = (p00.b * (256 - wx) * (256 - wy) + p01.b * wx * (256 - wy)
+                 + p10.b * (256 - wx) * wy + p11.b * wx * wy + 32768) >> 16;
+        }
+      }
+      PIX(out, y, x) = p;
+    }
+  }
+  return out;
+}
+
+Image downscale_ref(const Image in, int factor, ScaleMode mode) {
+  if (in.data == NULL) {
+    return in;
+  }
+  Image out = make_image((in.rows + factor - 1) / factor, (in.cols + factor - 1) / factor);
+  if (out.data == NULL) {
+    return out;
+  }
+
+  for (int y = 0; y < out.rows; y++) {
+    for (int x = 0; x < out.cols; x++) {
+      if (mode == SCALE_DECIMATE) {
+        PIX(out, y, x) = PIX(in, y * factor, x * factor);
+        continue;
+      }
+
+      int r = 0, g = 0, b = 0, n = 0;
+      for (int yy = y * factor; yy < (y + 1) * factor && yy < in.rows; yy++) {
+        for (int xx = x * factor; xx < (x + 1) * factor && xx < in.cols; xx++) {
+          r += PIX(in, yy, xx).r;
+          g += PIX(in, yy, xx).g;
+          b += PIX(in, yy, xx).b;
+          n++;
+        }
+      }
+      PIX(out, y, x).r = (r + n / 2) / n;
+      PIX(out, y, x).g = (g + n / 2) / n;
+      PIX(out, y, x).b = (b + n / 2) / n;
+    }
+  }
+  return out;
+}
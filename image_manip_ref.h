@@ -0,0 +1,63 @@
+#ifndef IMAGE_MANIP_REF_H
+#define IMAGE_MANIP_REF_H
+
+#include "ppm_io.h"
+#include "image_manip.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/////////////////////////////////////////////////
+// Reference implementations for cross-checks //
+/////////////////////////////////////////////////
+
+/* Straightforward single-threaded versions of the operations in
+* image_manip.h: one pixel at a time, no banding, no unrolling, no
+* cached state. They define the expected output of the optimized
+* kernels and are used by `project --verify` and `make check`.
+*/
+
+/* grayscale and saturate are checked as their color matrices */
+Image grayscale_ref( const Image in );
+
+Image blend_ref( const Image in1, const Image in2 , double alpha );
+
+Image rotate_ccw_ref( const Image in );
+
+/* uses rand() exactly like pointilism, so seed both the same way */
+Image pointilism_ref( const Image in );
+
+Image blur_ref( const Image in , double sigma );
+
+Image saturate_ref( const Image in , double scale );
+
+Image color_matrix_ref( const Image in , const double m[12] );
+
+Image auto_levels_ref( const Image in , double low_pct , double high_pct );
+
+Image convolve_ref( const Image in , const Kernel * k );
+
+Image median_ref( const Image in , int radius );
+
+/* blur_ref followed by a separate combining pass */
+Image unsharp_ref( const Image in , double sigma , double amount , int threshold );
+
+Image stack_ref( const Image * in , int n , StackMode mode );
+
+Image morph_ref( const Image in , MorphOp op , int width , int height );
+
+/* the same bilateral grid as bilateral(), built serially */
+Image bilateral_ref( const Image in , double sigma_s , double sigma_r );
+
+/* rotate is checked as affine_ref with rotation_matrix() */
+Image affine_ref( const Image in , const double m[6] , int bilinear );
+
+/* what read_ppm_scaled should produce from the full-size image */
+Image downscale_ref( const Image in , int factor , ScaleMode mode );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
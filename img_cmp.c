@@ -2,17 +2,6 @@
 #include <stdlib.h>
 #include "ppm_io.h"
 
-int check_color(unsigned char c1, unsigned c2, int max_delta) {
-	int diff = abs((int)c1 - (int)c2);
-	return diff <= max_delta;
-}
-
-int check_pixels(Pixel p1, Pixel p2, int max_delta) {
-	return check_color(p1.r, p2.r, max_delta)
-		&& check_color(p1.g, p2.g, max_delta)
-		&& check_color(p1.b, p2.b, max_delta);
-}
-
 int main(int argc, char **argv) {
 	if (argc != 4) {
 		printf("Usage: %s <max delta> <file1> <file2>\n", argv[0]);
@@ -55,26 +44,18 @@ int main(int argc, char **argv) {
 	fclose(fp1);
 	fclose(fp2);
 
-	if (im1.cols != im2.cols || im1.rows != im2.rows) {
+	// Count the number of pixels containing color component values
+	// that differ than more than the max delta
+	ImageDiff diff;
+	if (compare_images(im1, im2, max_delta, &diff) != 0) {
 		free_image(&im1);
 		free_image(&im2);
 		printf("Image dimensions differ\n");
 		return 1;
 	}
+	size_t mismatched = diff.mismatched;
 
-	// Count the number of pixels containing color component values
-	// that differ than more than the max delta
-	int mismatched = 0;
-	int num_pixels = im1.cols * im1.rows;
-	for (int i = 0; i < num_pixels; i++) {
-		Pixel p1 = im1.data[i];
-		Pixel p2 = im2.data[i];
-		if (!check_pixels(p1, p2, max_delta)) {
-			mismatched++;
-		}
-	}
-
-	printf("Number of mismatched pixels: %d\n", mismatched);
+	printf("Number of mismatched pixels: %zu\n", mismatched);
 
 	free_image(&im1);
 	free_image(&im2);
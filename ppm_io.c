@@ -1,32 +1,35 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
 #include <string.h>
 #include <assert.h>
 #include <ctype.h>
 #include "ppm_io.h"
+#include "trace.h"
 
 
 
 /* helper function for read_ppm, takes a filehandle
  * and reads a number, but detects and skips comment lines
+ * and whitespace in front of it. Whitespace after the number
+ * is left alone, since after the last header field it may be
+ * followed by pixel bytes that happen to look like whitespace.
  */
 int read_num( FILE *fp ) {
   assert(fp);
 
   int ch;
-  while((ch = fgetc(fp)) == '#') { // # marks a comment line
-    while( ((ch = fgetc(fp)) != '\n') && ch != EOF ) {
-      /* discard characters til end of line */
+  while((ch = fgetc(fp)) == '#' || isspace(ch)) {
+    if (ch == '#') { // # marks a comment line
+      while( ((ch = fgetc(fp)) != '\n') && ch != EOF ) {
+        /* discard characters til end of line */
+      }
     }
   }
   ungetc(ch, fp); // put back the last thing we found
 
   int val;
   if (fscanf(fp, "%d", &val) == 1) { // try to get an int
-    while(isspace(ch = fgetc(fp))) {
-      // drop trailing whitespace
-    }
-    ungetc(ch, fp);
     return val; // we got a value, so return it
   } else {
     fprintf(stderr, "Error:ppm_io - failed to read number from file\n");
@@ -34,49 +37,67 @@ int read_num( FILE *fp ) {
   }
 }
 
-Image read_ppm( FILE *fp ) {
-  Image im = { NULL , 0 , 0 };
-  
+/* reads and checks the header up to the first pixel byte;
+ * returns 0 and the dimensions, or -1 after printing the error */
+int read_ppm_header( FILE *fp , int *rows , int *cols ) {
   /* confirm that we received a good file handle */
   if( !fp ){
 	fprintf( stderr , "Error:ppm_io - bad file pointer\n" );
-	return im;
+	return -1;
   }
 
-  int rows=-1 , cols=-1;
-
   /* read in tag; fail if not P6 */
   char tag[20];
   tag[19] = '\0';
-  int chk = fscanf( fp , "%19s\n" , tag);
+  int chk = fscanf( fp , "%19s" , tag);
   if (chk != 1) {
     fprintf(stderr, "Error:ppm_io - failed to read string from file\n");
-    return im;
+    return -1;
   }
   
   if( strncmp( tag , "P6" , 20 ) ) {
 	fprintf( stderr , "Error:ppm_io - not a PPM (bad tag)\n" );
-	return im;
+	return -1;
   }
 
 
   /* read image dimensions */
 
   //read in columns
-  cols = read_num( fp ); // NOTE: cols, then rows (i.e. X size followed by Y size)
+  *cols = read_num( fp ); // NOTE: cols, then rows (i.e. X size followed by Y size)
   //read in rows
-  rows = read_num( fp );
+  *rows = read_num( fp );
 
   //read in colors; fail if not 255
   int colors = read_num( fp );
+  //exactly one whitespace character separates the header from the pixels
+  if( !isspace( fgetc( fp ) ) ) {
+	colors = -1;
+  }
   if( colors!=255 ) {
 	fprintf( stderr , "Error:ppm_io - PPM file with colors different from 255\n" );
-	return im;
+	return -1;
   }
 
   //confirm that dimensions are positive
-  if( cols<=0 || rows<=0 ) {
+  if( *cols<=0 || *rows<=0 ) {
 	fprintf( stderr , "Error:ppm_io - PPM file with non-positive dimensions\n" );
+	return -1;
+  }
+  //and that the pixels can be addressed at all
+  if( image_bytes( *rows , *cols ) == 0 ) {
+	fprintf( stderr , "Error:ppm_io - PPM file too large to address\n" );
+	return -1;
+  }
+  return 0;
+}
+
+Image read_ppm( FILE *fp ) {
+  Image im = { NULL , 0 , 0 , 0 };
+  unsigned long long t0 = trace_now();
+
+  int rows , cols;
+  if( read_ppm_header( fp , &rows , &cols ) != 0 ) {
 	return im;
   }
 
@@ -89,57 +110,194 @@ Image read_ppm( FILE *fp ) {
   /* finally, read in Pixels */
 
   /* read in the binary Pixel data */
-  if( fread( im.data , sizeof(Pixel) , im.rows * im.cols , fp ) != (size_t)(im.rows * im.cols) ) {
+  size_t n = (size_t)im.rows * im.cols;
+  if( fread( im.data , sizeof(Pixel) , n , fp ) != n ) {
     fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
 	  free_image( &im );
     return im;
   }
 
+  trace_span( "io" , "read_ppm" , t0 , -1 );
   //return the image struct pointer
   return im;
 }
 
+/* reduce one band of up to factor input rows to one output row:
+ * either keep the top-left pixel of each block, or average the block
+ * (blocks cut off by the right or bottom edge average what is there) */
+static void reduce_band( const Pixel *band , int band_rows , int cols , int factor ,
+                         ScaleMode mode , Pixel *out , int out_cols ) {
+  if( mode == SCALE_DECIMATE ) {
+    for( int x = 0 ; x < out_cols ; x++ ) {
+      out[x] = band[x * factor];
+    }
+    return;
+  }
+
+  for( int x = 0 ; x < out_cols ; x++ ) {
+    int x0 = x * factor;
+    int w = cols - x0 < factor ? cols - x0 : factor;
+    unsigned int r = 0 , g = 0 , b = 0;
+    for( int y = 0 ; y < band_rows ; y++ ) {
+      const Pixel *p = band + (size_t)y * cols + x0;
+      for( int i = 0 ; i < w ; i++ ) {
+        r += p[i].r;
+        g += p[i].g;
+        b += p[i].b;
+      }
+    }
+    //round to nearest
+    unsigned int n = (unsigned int)(w * band_rows);
+    out[x].r = (r + n / 2) / n;
+    out[x].g = (g + n / 2) / n;
+    out[x].b = (b + n / 2) / n;
+  }
+}
+
+Image read_ppm_scaled( FILE *fp , int factor , ScaleMode mode ) {
+  Image im = { NULL , 0 , 0 , 0 };
+
+  if( factor == 1 ) {
+	return read_ppm( fp );
+  }
+  if( factor != 2 && factor != 4 && factor != 8 ) {
+	fprintf( stderr , "Error:ppm_io - unsupported scale factor %d\n" , factor );
+	return im;
+  }
+
+  unsigned long long t0 = trace_now();
+  int rows , cols;
+  if( read_ppm_header( fp , &rows , &cols ) != 0 ) {
+	return im;
+  }
+
+  /* only factor input rows are held at a time */
+  Pixel *band = malloc( sizeof(Pixel) * (size_t)cols * factor );
+  im = make_image( (rows + factor - 1) / factor , (cols + factor - 1) / factor );
+  if( !band || !im.data ){
+	fprintf( stderr , "Error:ppm_io - Could not allocate new image\n" );
+	free( band );
+	free_image( &im );
+	return im;
+  }
+
+  for( int y = 0 ; y < im.rows ; y++ ) {
+    int band_rows = rows - y * factor < factor ? rows - y * factor : factor;
+    size_t n = (size_t)cols * band_rows;
+    if( fread( band , sizeof(Pixel) , n , fp ) != n ) {
+      fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
+      free( band );
+      free_image( &im );
+      return im;
+    }
+    reduce_band( band , band_rows , cols , factor , mode , image_row( im , y ) , im.cols );
+  }
+
+  free( band );
+  trace_span( "io" , "read_ppm_scaled" , t0 , factor );
+  return im;
+}
+
+
 
+/* read the next rows.rows rows of pixels into rows */
+int read_ppm_rows( FILE *fp , Image rows ) {
+  for (int y = 0; y < rows.rows; y++) {
+    if (fread(image_row(rows, y), sizeof(Pixel), rows.cols, fp) != (size_t)rows.cols) {
+      fprintf(stderr, "Error:ppm_io - failed to read data from file!\n");
+      return -1;
+    }
+  }
+  return 0;
+}
 
 /* Write given image to disk as a PPM; assumes fp is not null */
 int write_ppm( FILE *fp , const Image im ) {
-  // Complete this function
   if (fp == NULL) {
     fprintf(stderr, "Unable to open write-to file\n");
     return 7;
   }
-  
-  fprintf(fp, "P6\n%d %d\n255\n", im.cols, im.rows);
+  unsigned long long t0 = trace_now();
+
+  int chk = write_ppm_header(fp, im.rows, im.cols);
+  if (chk == 0) {
+    chk = write_ppm_rows(fp, im);
+  }
+  trace_span("io", "write_ppm", t0, -1);
+  return chk;
+}
+
+/* write the PPM header for a rows x cols image */
+int write_ppm_header( FILE *fp , int rows , int cols ) {
+  fprintf(fp, "P6\n%d %d\n255\n", cols, rows);
 
   if (ferror(fp)) {fprintf(stderr, "File in error state\n"); return 7;}
-  
-  int check_write = fwrite(im.data, sizeof(Pixel), im.rows * im.cols, fp);
+  return 0;
+}
 
-  
-  if (check_write != im.rows * im.cols) {
-    fprintf(stderr, "Error creating image\n");
-    return 8;
+/* write the pixels of im after a header or earlier rows */
+int write_ppm_rows( FILE *fp , const Image im ) {
+  //packed images go out in one write, padded ones row by row
+  if (im.stride == im.cols) {
+    size_t n = (size_t)im.rows * im.cols;
+    if (fwrite(im.data, sizeof(Pixel), n, fp) != n) {
+      fprintf(stderr, "Error creating image\n");
+      return 8;
+    }
+    return 0;
+  }
+
+  for (int y = 0; y < im.rows; y++) {
+    if (fwrite(image_row(im, y), sizeof(Pixel), im.cols, fp) != (size_t)im.cols) {
+      fprintf(stderr, "Error creating image\n");
+      return 8;
+    }
   }
   return 0;
 }
 
 
+/* bytes of pixel data in a rows x cols image, or 0 if that
+ * is not a positive size_t */
+size_t image_bytes( int rows , int cols ) {
+  if (rows <= 0 || cols <= 0 || (size_t)cols > SIZE_MAX / sizeof(Pixel) / (size_t)rows) {
+    return 0;
+  }
+  return sizeof(Pixel) * (size_t)rows * (size_t)cols;
+}
+
 /* allocate a new image of the specified size;
  * doesn't initialize pixel values */
 Image make_image( int rows , int cols ) {
-  // Complete this function
-
-  Pixel *data = malloc(sizeof(Pixel) * rows * cols);
+  size_t bytes = image_bytes(rows, cols);
+  Pixel *data = bytes ? malloc(bytes) : NULL;
 
   Image im;
   im.data = data;
   im.rows = rows;
   im.cols = cols;
+  im.stride = cols;
 
   return im;
 }
 
 
+/* view of a rectangle inside an image; shares the pixels, no copy */
+Image image_view( const Image im , int x , int y , int w , int h ) {
+  Image view = { NULL , 0 , 0 , 0 };
+  if (im.data == NULL || x < 0 || y < 0 || w <= 0 || h <= 0
+      || x > im.cols - w || y > im.rows - h) {
+    return view;
+  }
+
+  view.data = image_row(im, y) + x;
+  view.rows = h;
+  view.cols = w;
+  view.stride = im.stride;
+  return view;
+}
+
+
 /* output dimensions of the image to stdout */
 void output_dims( const Image im ) {
   printf( "cols = %d, rows = %d" , im.cols , im.rows );
@@ -156,3 +314,51 @@ void free_image( Image *im ) {
   im->data = NULL;
   
 }
+
+
+/* check whether two color components are within max_delta of each other */
+static int check_color(unsigned char c1, unsigned char c2, int max_delta) {
+  int diff = abs((int)c1 - (int)c2);
+  return diff <= max_delta;
+}
+
+static int check_pixels(Pixel p1, Pixel p2, int max_delta) {
+  return check_color(p1.r, p2.r, max_delta)
+    && check_color(p1.g, p2.g, max_delta)
+    && check_color(p1.b, p2.b, max_delta);
+}
+
+static int channel_delta(unsigned char c1, unsigned char c2) {
+  return abs((int)c1 - (int)c2);
+}
+
+/* compare two images pixel by pixel, counting the pixels that have
+ * a color component differing by more than max_delta */
+int compare_images( const Image a , const Image b , int max_delta , ImageDiff *diff ) {
+  diff->mismatched = 0;
+  diff->max_delta = 0;
+  if (a.rows != b.rows || a.cols != b.cols) {
+    return -1;
+  }
+
+  for (int y = 0; y < a.rows; y++) {
+    const Pixel *pa = image_row(a, y);
+    const Pixel *pb = image_row(b, y);
+    for (int x = 0; x < a.cols; x++) {
+      if (!check_pixels(pa[x], pb[x], max_delta)) {
+        diff->mismatched++;
+      }
+      int d = channel_delta(pa[x].r, pb[x].r);
+      if (channel_delta(pa[x].g, pb[x].g) > d) {
+        d = channel_delta(pa[x].g, pb[x].g);
+      }
+      if (channel_delta(pa[x].b, pb[x].b) > d) {
+        d = channel_delta(pa[x].b, pb[x].b);
+      }
+      if (d > diff->max_delta) {
+        diff->max_delta = d;
+      }
+    }
+  }
+  return 0;
+}
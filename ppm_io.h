@@ -2,6 +2,11 @@
 #define PPM_IO_H
 
 #include <stdio.h>
+#include <stddef.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
 
 /* struct to store a point */
 typedef struct {
@@ -18,16 +23,38 @@ typedef struct {
 
 /* struct to store an entire image
  * pixels are linearized in row-major order, with the first block of pixels corresponding to the first row, then the second, etc.
+ * stride is the distance in pixels between the starts of consecutive rows (>= cols);
+ * images from make_image and read_ppm are tightly packed, i.e. stride == cols.
+ * Each dimension is an int, but pixel counts, offsets and byte sizes are
+ * size_t throughout, so images past 2^31 pixels or bytes are fine
  */
 typedef struct {
   Pixel *data;
   int rows;
   int cols;
+  int stride;
 } Image;
 
+/* pointer to the first pixel of row y */
+static inline Pixel * image_row( const Image im , int y ) {
+  return im.data + (size_t)y * im.stride;
+}
+
 /* read PPM formatted image from a file (assumes fp != NULL) */
 Image read_ppm( FILE * fp );
 
+/* how read_ppm_scaled reduces each factor x factor block of pixels */
+typedef enum {
+  SCALE_DECIMATE ,  // keep the top-left pixel
+  SCALE_AREA        // average the block
+} ScaleMode;
+
+/* read a PPM shrunk by factor (1, 2, 4 or 8) in each direction, to
+ * (rows + factor - 1) / factor by (cols + factor - 1) / factor pixels;
+ * the pixels are reduced as they are read, factor rows at a time, so
+ * the full-size image is never held in memory */
+Image read_ppm_scaled( FILE * fp , int factor , ScaleMode mode );
+
 /* write PPM formatted image to a file (assumes fp != NULL) */
 int write_ppm( FILE * fp , const Image img );
 
@@ -35,11 +62,43 @@ int write_ppm( FILE * fp , const Image img );
  * and set to null */
 void free_image( Image * im );
 
-/* allocate a new image of the specified size;
+/* Row streaming, for work that should not hold whole images: read the
+ * header, then read or write the pixels a few rows at a time. The rows
+ * image gives how many rows are transferred and may be a view. */
+int read_ppm_header( FILE * fp , int * rows , int * cols );
+int read_ppm_rows( FILE * fp , Image rows );
+int write_ppm_header( FILE * fp , int rows , int cols );
+int write_ppm_rows( FILE * fp , const Image rows );
+
+/* bytes of pixel data in a rows x cols image; 0 if a dimension is not
+ * positive or the size does not fit in a size_t */
+size_t image_bytes( int rows , int cols );
+
+/* allocate a new image of the specified size; data is NULL if the
+ * size is not positive, overflows or can't be allocated;
  * doesn't initialize pixel values */
 Image make_image( int rows , int cols );
 
+/* view of the w x h rectangle whose top-left pixel is (x, y): shares
+ * im's pixels and stride, so nothing is copied. data is NULL if the
+ * rectangle is not inside im. A view must never be passed to free_image. */
+Image image_view( const Image im , int x , int y , int w , int h );
+
 /* output dimensions of the image to stdout */
 void output_dims( const Image im );
 
+/* result of comparing two images pixel by pixel */
+typedef struct {
+  size_t mismatched;  // pixels with a channel differing by more than max_delta
+  int max_delta;    // largest difference seen in any channel
+} ImageDiff;
+
+/* compare two images of the same size; returns 0, or -1 if
+ * the dimensions differ */
+int compare_images( const Image a , const Image b , int max_delta , ImageDiff * diff );
+
+#ifdef __cplusplus
+}
+#endif
+
 #endif
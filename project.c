@@ -1,10 +1,18 @@
 //project.c
 
+#define _POSIX_C_SOURCE 200809L
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <limits.h>
+#include <sys/resource.h>
 #include "ppm_io.h"
 #include "image_manip.h"
+#include "image_manip_ref.h"
+#include "serve.h"
+#include "trace.h"
+#include "cache.h"
 
 // Return (exit) codes
 #define RC_SUCCESS            0
@@ -16,8 +24,57 @@
 #define RC_OP_ARGS_RANGE_ERR  6
 #define RC_WRITE_FAILED       7
 #define RC_UNSPECIFIED_ERR    8
+#define RC_VERIFY_FAILED      9
+
+// set by --verify: recompute every result with the reference backend
+static int verify_mode = 0;
+
+// rows of every input that stack holds per thread, and the most
+// memory the slices of all inputs may take (never below STACK_ROWS rows)
+#define STACK_ROWS 8
+#define STACK_SLICE_BYTES (64 << 20)
+
+// descriptors stack leaves for the output, standard streams, trace and serve
+#define STACK_SPARE_FILES 8
+
+// set by --serve: context and output buffer kept warm across jobs
+static ImageContext *job_ctx = NULL;
+static Pixel *out_cache = NULL;
+static size_t out_cache_size = 0;  // bytes
+// the current --serve job's reply stream, which gets stats written to "-"
+static FILE *job_reply = NULL;
+
+// set by --roi: handlers see a view of roi_rect inside roi_base, widened
+// by the reach of the command's neighbourhood, and the roi_rect part of
+// their result is pasted back into roi_base before it is written
+static int roi_active = 0;
+static int roi_rect[4];
+static int roi_offset[2];  // of roi_rect inside the handler's view
+static Image roi_base;
+
+// set by --downscale: inputs are shrunk by read_scale while they are decoded
+static int read_scale = 1;
+static ScaleMode read_mode = SCALE_AREA;
+
+// set by --cache: results are looked up in and stored to this directory
+static const char *cache_dir = NULL;
+static long long cache_max_bytes = 1024LL << 20;
 
 void print_usage();
+int run_command(int argc, char* argv[]);
+int run_job(int argc, char* argv[], FILE *reply);
+Image output_image(int rows, int cols);
+void release_output(Image *out);
+void release_input(Image *im);
+Image inplace_output(Image im);
+void release_inplace_output(Image *out, Image im);
+int write_output(FILE *output_file, char* input[], int argc, Image im, Image out);
+int parse_ints(const char* arg, int *vals, int n);
+Image read_input(FILE *fp);
+int verify_downscale(const char* path, Image im);
+unsigned long long job_key(char* input[], int argc, Image im);
+const char* output_path(char* input[]);
+void report_cache(int hit, int evicted);
 int handle_operations(char* input[], int argc);
 int handle_grayscale(char* input[], int argc, Image im);
 int handle_blend(char* input[], int argc, Image im);
@@ -25,27 +82,264 @@ int handle_rotate(char* input[], int argc, Image im);
 int handle_blur(char* input[], int argc, Image im);
 int handle_pointilism(char* input[], int argc, Image im);
 int handle_saturate(char* input[], int argc, Image im);
+int handle_stats(char* input[], int argc, Image im);
+int handle_auto_levels(char* input[], int argc, Image im);
+int handle_convolve(char* input[], int argc, Image im);
+int handle_rotate_angle(char* input[], int argc, Image im);
+int handle_affine(char* input[], int argc, Image im);
+int handle_color_matrix(char* input[], int argc, Image im);
+int handle_crop(char* input[], int argc, Image im);
+int handle_median(char* input[], int argc, Image im);
+int handle_unsharp(char* input[], int argc, Image im);
+int handle_bilateral(char* input[], int argc, Image im);
+int handle_stack(char* input[], int argc);
+int handle_morph(char* input[], int argc, Image im, MorphOp op);
+int morph_op(const char* cmd);
+void roi_margin(char* input[], int argc, int margin[2]);
+int verify_stack(char* input[], int argc, StackMode mode);
+int verify_result(char* input[], int argc, Image im, Image out);
+int parse_sampling(char* input[], int argc, int index);
+int parse_matrix(const char* arg, double m[6]);
+int parse_doubles(const char* arg, double *vals, int n);
+int parse_color_matrix(const char* arg, double m[12]);
+Kernel load_kernel_arg(const char* arg);
+unsigned int pointilism_seed(char* input[], int argc);
 
 int main (int argc, char* argv[]) {
+  //--serve keeps the process, thread pool and buffers around for many jobs
+  if (argc > 1 && strcmp(argv[1], "--serve") == 0) {
+    if (argc != 3) {
+      printf("Usage: %s --serve <socket path | ->\n", argv[0]);
+      return RC_MISSING_FILENAME;
+    }
+    job_ctx = context_create(0);
+    if (job_ctx == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      return RC_UNSPECIFIED_ERR;
+    }
+    int rc = serve(argv[2], run_job);
+    context_destroy(job_ctx);
+    free(out_cache);
+    return rc == 0 ? RC_SUCCESS : RC_UNSPECIFIED_ERR;
+  }
+
+  return run_command(argc, argv);
+}
+
+/*
+runs a --serve job: a command line whose text results go to reply
+*/
+int run_job(int argc, char* argv[], FILE *reply) {
+  job_reply = reply;
+  int rc = run_command(argc, argv);
+  job_reply = NULL;
+  return rc;
+}
+
+/*
+runs a single command line, either from main or as a --serve job
+*/
+int run_command(int argc, char* argv[]) {
+  //options go before the usual arguments
+  verify_mode = 0;
+  roi_active = 0;
+  read_scale = 1;
+  read_mode = SCALE_AREA;
+  const char *trace_path = NULL;
+  cache_dir = NULL;
+  cache_max_bytes = 1024LL << 20;
+  while (argc > 1 && strncmp(argv[1], "--", 2) == 0) {
+    if (strcmp(argv[1], "--verify") == 0) {
+      verify_mode = 1;
+    } else if (strcmp(argv[1], "--roi") == 0 && argc > 2) {
+      if (parse_ints(argv[2], roi_rect, 4) != 0) {
+        fprintf(stderr, "--roi expects x,y,w,h\n");
+        return RC_INVALID_OP_ARGS;
+      }
+      roi_active = 1;
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--downscale") == 0 && argc > 2) {
+      char *end;
+      read_scale = (int)strtol(argv[2], &end, 10);
+      if (strcmp(end, ",nearest") == 0) {
+        read_mode = SCALE_DECIMATE;
+        end += strlen(end);
+      }
+      if (*end != '\0' || (read_scale != 2 && read_scale != 4 && read_scale != 8)) {
+        fprintf(stderr, "--downscale expects 2, 4 or 8, optionally followed by ,nearest\n");
+        return RC_INVALID_OP_ARGS;
+      }
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--cache") == 0 && argc > 2) {
+      cache_dir = argv[2];
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--cache-max") == 0 && argc > 2) {
+      char *end;
+      long long mb = strtoll(argv[2], &end, 10);
+      //checked before the shift, which would overflow
+      if (end != argv[2] && *end == '\0' && mb >= 0 && mb <= LLONG_MAX >> 20) {
+        cache_max_bytes = mb << 20;
+      } else {
+        fprintf(stderr, "--cache-max expects a size in MB\n");
+        return RC_INVALID_OP_ARGS;
+      }
+      argv++;
+      argc--;
+    } else if (strcmp(argv[1], "--trace") == 0 && argc > 2) {
+      trace_path = argv[2];
+      argv++;
+      argc--;
+    } else {
+      fprintf(stderr, "Unknown option %s\n", argv[1]);
+      return RC_INVALID_OP_ARGS;
+    }
+    argv++;
+    argc--;
+  }
+
   if (argc < 4) {
     printf("Please enter an image.ppm file\n");
-    return RC_MISSING_FILENAME; 
+    return RC_MISSING_FILENAME;
+  }
+
+  if (trace_path == NULL) {
+    return handle_operations(argv, argc);
+  }
+
+  trace_start();
+  unsigned long long t0 = trace_now();
+  int rc = handle_operations(argv, argc);
+  trace_span("job", "job", t0, rc);
+  if (trace_write(trace_path) != 0 && rc == RC_SUCCESS) {
+    rc = RC_WRITE_FAILED;
+  }
+  return rc;
+}
+
+/*
+output image for a handler: freshly allocated for a single run,
+the reused cache buffer when serving
+*/
+Image output_image(int rows, int cols) {
+  if (job_ctx == NULL) {
+    return make_image(rows, cols);
+  }
+
+  Image out = { NULL, rows, cols, cols };
+  size_t needed = image_bytes(rows, cols);
+  if (needed == 0) {
+    return out;
+  }
+  if (needed > out_cache_size) {
+    Pixel *grown = realloc(out_cache, needed);
+    if (grown == NULL) {
+      return out;
+    }
+    out_cache = grown;
+    out_cache_size = needed;
+  }
+  out.data = out_cache;
+  return out;
+}
+
+void release_output(Image *out) {
+  if (job_ctx == NULL) {
+    free_image(out);
+  } else {
+    out->data = NULL;
+  }
+}
+
+/*
+handlers release their input through this; with --roi it is only a view
+and the full image is freed by handle_operations
+*/
+void release_input(Image *im) {
+  if (roi_active) {
+    im->data = NULL;
+  } else {
+    free_image(im);
+  }
+}
+
+/*
+output for kernels that can run in place: the input itself, so a large
+image is held only once, unless --verify still needs the input
+*/
+Image inplace_output(Image im) {
+  return verify_mode ? output_image(im.rows, im.cols) : im;
+}
+
+void release_inplace_output(Image *out, Image im) {
+  if (out->data == im.data) {
+    out->data = NULL;
+  } else {
+    release_output(out);
+  }
+}
+
+/*
+verifies the result if asked to, then writes it; with --roi the result
+is pasted into the region of the full image and the full image written
+*/
+int write_output(FILE *output_file, char* input[], int argc, Image im, Image out) {
+  int chk = RC_SUCCESS;
+  if (verify_mode) {
+    unsigned long long t0 = trace_now();
+    chk = verify_result(input, argc, im, out);
+    trace_span("verify", "verify", t0, -1);
+  }
+
+  if (roi_active) {
+    Image dst = image_view(roi_base, roi_rect[0], roi_rect[1], roi_rect[2], roi_rect[3]);
+    Image src = image_view(out, roi_offset[0], roi_offset[1], roi_rect[2], roi_rect[3]);
+    for (int y = 0; y < dst.rows && out.data != im.data; y++) {
+      memcpy(image_row(dst, y), image_row(src, y), sizeof(Pixel) * dst.cols);
+    }
+    out = roi_base;
   }
-   
-  return handle_operations(argv, argc);
+
+  int write_chk = write_ppm(output_file, out);
+  return write_chk != RC_SUCCESS ? write_chk : chk;
 }
 
 
 
 void print_usage() {
-  printf("USAGE: ./project <input-image> <output-image> <command-name> <command-args>\n");
+  printf("USAGE: ./project [--verify] [--trace out.json] [--cache dir [--cache-max MB]] [--downscale n[,nearest]] [--roi x,y,w,h] <input-image> <output-image> <command-name> <command-args>\n");
+  printf("       ./project --serve <socket path | ->\n");
+  printf("  --verify   also run the reference implementation and report any mismatch\n");
+  printf("  --serve    run jobs (one command line per line) from a UNIX socket or stdin\n");
+  printf("  --trace    write a timeline of the run (Chrome trace format) to out.json\n");
+  printf("  --cache    reuse results stored in dir for identical inputs and arguments\n");
+  printf("  --cache-max  size cap of the cache in MB (default 1024)\n");
+  printf("  --downscale  read the input(s) at 1/2, 1/4 or 1/8 size, averaging each block\n");
+  printf("             (\"8,nearest\" keeps one pixel per block instead)\n");
+  printf("  --roi      apply the command to the rectangle at x,y of size w x h only\n");
   printf("SUPPORTED COMMANDS:\n");
   printf("   grayscale\n" );
   printf("   blend <target image> <alpha value>\n" );
   printf("   rotate-ccw\n" );
-  printf("   pointilism\n" );
-  printf("   blur <sigma>\n" );
+  printf("   pointilism [seed]\n" );
+  printf("   blur <sigma>   (0.1 to %d)\n", BLUR_MAX_SIGMA );
   printf("   saturate <scale>\n" );
+  printf("   stats                (writes a text report; use - for stdout)\n" );
+  printf("   auto-levels [<low percentile> <high percentile>]\n" );
+  printf("   convolve <kernel file | sharpen | sobel-x | sobel-y | emboss | laplacian | box | gaussian5>\n" );
+  printf("             kernel file: <size> <size*size int taps> [<divisor> [<bias>]]; odd size up to %d,\n", KERNEL_MAX_SIZE );
+  printf("             255 * sum(|taps|) must fit an int, divisor > 0 (default: sum of taps, or 1), |bias| <= %d\n", KERNEL_MAX_BIAS );
+  printf("   rotate <degrees> [nearest | bilinear]\n" );
+  printf("   affine <a,b,c,d,e,f> [nearest | bilinear]   (x' = ax + by + c, y' = dx + ey + f)\n" );
+  printf("   color-matrix <grayscale | sepia | invert | bgr | 12 comma separated values>   (rows r,g,b of m_r,m_g,m_b,offset)\n" );
+  printf("   crop <x> <y> <width> <height>\n" );
+  printf("   median <radius>   (1 to %d)\n", MEDIAN_MAX_RADIUS );
+  printf("   unsharp <sigma> <amount> <threshold>\n" );
+  printf("   bilateral <sigma_s> <sigma_r>   (both at least 1)\n" );
+  printf("   erode | dilate | open | close <width> [height]   (1 to %d, height defaults to width)\n", MORPH_MAX_SIZE );
+  printf("   stack <mean | median | max | min> <image 2> ... <image N>   (the input image is image 1)\n" );
 }
 
 /*
@@ -53,15 +347,19 @@ function that handles all the input from the main function
 */
 
 int handle_operations(char* input[], int argc) {
+  //stack streams its inputs itself instead of loading them
+  if (strcmp(input[3], "stack") == 0) {
+    return handle_stack(input, argc);
+  }
+
   FILE *image_name = fopen(input[1], "r");
   if (image_name == NULL) {
     fprintf(stderr, "Failed to open input file.\n");
-    fclose(image_name);
     return RC_OPEN_FAILED;
   }
   
   //check to see if memory failed
-  Image im = read_ppm(image_name);
+  Image im = read_input(image_name);
   if (im.data == NULL) {
     fprintf(stderr, "Failed to allocate memory\n");
     fclose(image_name);
@@ -74,46 +372,157 @@ int handle_operations(char* input[], int argc) {
   }
 
   fclose(image_name);
-  
+
+  if (verify_mode && read_scale > 1 && verify_downscale(input[1], im) != RC_SUCCESS) {
+    free_image(&im);
+    return RC_VERIFY_FAILED;
+  }
+
+  //a cached result is copied instead of recomputed; --verify always recomputes
+  unsigned long long key = 0;
+  int use_cache = cache_dir != NULL && strcmp(input[3], "stats") != 0;
+  if (use_cache) {
+    key = job_key(input, argc, im);
+    if (!verify_mode && cache_fetch(cache_dir, key, output_path(input)) == 0) {
+      report_cache(1, 0);
+      free_image(&im);
+      return RC_SUCCESS;
+    }
+  }
+
+  //with --roi the handler only sees a view of the region
+  if (roi_active) {
+    if (strcmp(input[3], "blend") == 0 || strcmp(input[3], "rotate-ccw") == 0
+        || strcmp(input[3], "crop") == 0) {
+      fprintf(stderr, "--roi is not supported for %s\n", input[3]);
+      free_image(&im);
+      return RC_INVALID_OP_ARGS;
+    }
+    roi_base = im;
+    im = image_view(roi_base, roi_rect[0], roi_rect[1], roi_rect[2], roi_rect[3]);
+    if (im.data == NULL) {
+      fprintf(stderr, "--roi rectangle is not inside the image\n");
+      free_image(&roi_base);
+      return RC_OP_ARGS_RANGE_ERR;
+    }
+
+    //filters read real neighbours around the region, not its replicated edge
+    int margin[2];
+    roi_margin(input, argc, margin);
+    int x0 = roi_rect[0] - margin[0] < 0 ? 0 : roi_rect[0] - margin[0];
+    int y0 = roi_rect[1] - margin[1] < 0 ? 0 : roi_rect[1] - margin[1];
+    //bilateral's grid cells start at the view's origin, so keep them on the
+    //full image's: a multiple of a whole cell, else the image's own origin
+    if (strcmp(input[3], "bilateral") == 0 && argc > 4) {
+      double cell = strtod(input[4], NULL);
+      int whole = cell >= 1 && cell <= roi_base.cols && cell == (int)cell;
+      x0 = whole ? x0 / (int)cell * (int)cell : 0;
+      y0 = whole ? y0 / (int)cell * (int)cell : 0;
+    }
+    int x1 = roi_base.cols - (roi_rect[0] + roi_rect[2]) < margin[0]
+             ? roi_base.cols : roi_rect[0] + roi_rect[2] + margin[0];
+    int y1 = roi_base.rows - (roi_rect[1] + roi_rect[3]) < margin[1]
+             ? roi_base.rows : roi_rect[1] + roi_rect[3] + margin[1];
+    roi_offset[0] = roi_rect[0] - x0;
+    roi_offset[1] = roi_rect[1] - y0;
+    im = image_view(roi_base, x0, y0, x1 - x0, y1 - y0);
+  }
+
+  int rc;
+
   //runs if command is grayscale
   if(strcmp(input[3], "grayscale") == 0) {
-    handle_grayscale(input, argc, im);
+    rc = handle_grayscale(input, argc, im);
 
     //runs if command is blend
   } else if(strcmp(input[3], "blend") == 0) {
-      handle_blend(input, argc, im);
+      rc = handle_blend(input, argc, im);
 
     //runs if command is rotate
   } else if(strcmp(input[3], "rotate-ccw") == 0) {
-      handle_rotate(input, argc, im);
+      rc = handle_rotate(input, argc, im);
 
     //runs if command is pointilism
   } else if(strcmp(input[3], "pointilism") == 0) {
-      handle_pointilism(input, argc, im);
+      rc = handle_pointilism(input, argc, im);
 
     //runs if command is blur
   } else if(strcmp(input[3], "blur") == 0) {
-      handle_blur(input, argc, im);
+      rc = handle_blur(input, argc, im);
 
     //runs if command is saturate
   } else if(strcmp(input[3], "saturate") == 0) {
-      handle_saturate(input, argc, im);
+      rc = handle_saturate(input, argc, im);
+
+    //runs if command is stats
+  } else if(strcmp(input[3], "stats") == 0) {
+      rc = handle_stats(input, argc, im);
+
+    //runs if command is auto-levels
+  } else if(strcmp(input[3], "auto-levels") == 0) {
+      rc = handle_auto_levels(input, argc, im);
+
+    //runs if command is convolve
+  } else if(strcmp(input[3], "convolve") == 0) {
+      rc = handle_convolve(input, argc, im);
+
+    //runs if command is rotate
+  } else if(strcmp(input[3], "rotate") == 0) {
+      rc = handle_rotate_angle(input, argc, im);
+
+    //runs if command is affine
+  } else if(strcmp(input[3], "affine") == 0) {
+      rc = handle_affine(input, argc, im);
+
+    //runs if command is color-matrix
+  } else if(strcmp(input[3], "color-matrix") == 0) {
+      rc = handle_color_matrix(input, argc, im);
+
+    //runs if command is crop
+  } else if(strcmp(input[3], "crop") == 0) {
+      rc = handle_crop(input, argc, im);
+
+    //runs if command is median
+  } else if(strcmp(input[3], "median") == 0) {
+      rc = handle_median(input, argc, im);
+
+    //runs if command is erode, dilate, open or close
+  } else if(morph_op(input[3]) >= 0) {
+      rc = handle_morph(input, argc, im, (MorphOp)morph_op(input[3]));
+
+    //runs if command is unsharp
+  } else if(strcmp(input[3], "unsharp") == 0) {
+      rc = handle_unsharp(input, argc, im);
+
+    //runs if command is bilateral
+  } else if(strcmp(input[3], "bilateral") == 0) {
+      rc = handle_bilateral(input, argc, im);
 
   } else {
     //unupported command
     fprintf(stderr, "Unsupported image processing operations\n");
-    free_image(&im);
-    return RC_INVALID_OPERATION;
+    release_input(&im);
+    rc = RC_INVALID_OPERATION;
   }
 
-  return RC_SUCCESS;
+  if (roi_active) {
+    free_image(&roi_base);
+  }
+  if (use_cache) {
+    int evicted = 0;
+    if (rc == RC_SUCCESS) {
+      evicted = cache_store(cache_dir, key, output_path(input), cache_max_bytes);
+    }
+    report_cache(0, evicted < 0 ? 0 : evicted);
+  }
+  return rc;
 }
 
 int handle_grayscale(char* input[], int argc, Image im) {
   //checks for right number of arguments
     if (argc != 4) {
       fprintf(stderr, "Incorrect number of arguments for the specified operation");
-	    free_image(&im);
+	    release_input(&im);
 	    return RC_INVALID_OP_ARGS;
     }
 
@@ -121,15 +530,24 @@ int handle_grayscale(char* input[], int argc, Image im) {
     FILE *output_file = fopen(input[2], "w");
     if (output_file == NULL) {
       fprintf(stderr, "Output file I/O error\n");
-      free_image(&im);
+      release_input(&im);
       return RC_WRITE_FAILED;
     }
 
-    Image out = grayscale(im);
-    int chk = write_ppm(output_file, out);
+    Image out = inplace_output(im);
+    if (out.data != NULL && grayscale_into(job_ctx, im, out) != IM_OK) {
+      release_inplace_output(&out, im);
+    }
+    if(out.data == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      release_input(&im);
+      fclose(output_file);
+      return RC_UNSPECIFIED_ERR;
+    }
+    int chk = write_output(output_file, input, argc, im, out);
 
-    free_image(&im);
-    free_image(&out);
+    release_inplace_output(&out, im);
+    release_input(&im);
     fclose(output_file);
     
     return chk;
@@ -139,27 +557,30 @@ int handle_blend(char* input[], int argc, Image im) {
   //checks for right number of arguments
       if (argc != 6) {
         fprintf(stderr, "Incorrect number of arguments for the specified operation");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_INVALID_OP_ARGS;
       }
       //allocates output image
       FILE *second_image = fopen(input[2], "r");
       if (second_image == NULL) {
         fprintf(stderr, "Input file I/O error");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_OPEN_FAILED;
       }
       
-      Image im2 = read_ppm(second_image);
+      Image im2 = read_input(second_image);
       if (im2.data == NULL) {
         fprintf(stderr, "Failed to allocate memory\n");
         fclose(second_image);
+        release_input(&im);
         return RC_INVALID_PPM;
       }
 
       if(im2.rows <= 0 || im2.cols <= 0) {
         fprintf(stderr, "Issues with the image file\n");
         fclose(second_image);
+        free_image(&im2);
+        release_input(&im);
         return RC_UNSPECIFIED_ERR;
       }
 
@@ -169,7 +590,7 @@ int handle_blend(char* input[], int argc, Image im) {
         fprintf(stderr, "Output file I/O error\n");
 	      fclose(second_image);
 	      free_image(&im2);
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_WRITE_FAILED;
       }
 
@@ -180,19 +601,30 @@ int handle_blend(char* input[], int argc, Image im) {
 	      fclose(second_image);
 	      fclose(output_file);
 	      free_image(&im2);
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_OP_ARGS_RANGE_ERR;
       }
 
       //preform edit
-      Image out = blend(im, im2, alpha);
-      int chk = write_ppm(output_file, out);
+      Image out = output_image(im.rows > im2.rows ? im.rows : im2.rows, im.cols > im2.cols ? im.cols : im2.cols);
+      if (out.data != NULL && blend_into(job_ctx, im, im2, out, alpha) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        fclose(second_image);
+        free_image(&im2);
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
 
       fclose(second_image);
       fclose(output_file);
-      free_image(&im);
+      release_input(&im);
       free_image(&im2);
-      free_image(&out);
+      release_output(&out);
     
       return chk;
 }
@@ -202,7 +634,7 @@ int handle_rotate(char* input[], int argc, Image im) {
   //checks for right number of arguments
       if (argc != 4) {
         fprintf(stderr, "Incorrect number of arguments for the specified operation");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_INVALID_OP_ARGS;
       }
 
@@ -210,17 +642,26 @@ int handle_rotate(char* input[], int argc, Image im) {
       FILE *output_file = fopen(input[2], "w");
       if (output_file == NULL) {
         fprintf(stderr, "Output file I/O error\n");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_WRITE_FAILED;
       }
 
       //preform edit
-      Image out = rotate_ccw(im);
-      int chk = write_ppm(output_file, out);
+      Image out = output_image(im.cols, im.rows);
+      if (out.data != NULL && rotate_ccw_into(job_ctx, im, out) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
 
       fclose(output_file);
-      free_image(&im);
-      free_image(&out);
+      release_input(&im);
+      release_output(&out);
     
       return chk;
 }
@@ -229,7 +670,7 @@ int handle_blur(char* input[], int argc, Image im) {
   //checks for right number of arguments
       if (argc != 5) {
         fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_INVALID_OP_ARGS;
       }
     
@@ -237,31 +678,34 @@ int handle_blur(char* input[], int argc, Image im) {
       FILE *output_file = fopen(input[2], "w");
       if (output_file == NULL) {
         fprintf(stderr, "Output file I/O error\n");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_WRITE_FAILED;
       }
 
       //checks if parameter is in bounds
       double sigma = strtod(input[4], NULL);
-      if (sigma < 0.1) {
+      if (sigma < 0.1 || sigma > BLUR_MAX_SIGMA) {
         fprintf(stderr, "Parameter not in bounds\n");
-	      free_image(&im);
+	      release_input(&im);
 	      fclose(output_file);
 	      return RC_OP_ARGS_RANGE_ERR;
       }
 
       //preform edit
-      Image out = blur(im, sigma);
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && blur_into(job_ctx, im, out, sigma) != IM_OK) {
+        release_output(&out);
+      }
       if(out.data == NULL) {
         fprintf(stderr, "Failed to allocate memory for Gauss Array\n");
-        free_image(&out);
-        free_image(&im);
+        release_input(&im);
+        fclose(output_file);
         return RC_UNSPECIFIED_ERR;
       }
-      int chk = write_ppm(output_file, out);
+      int chk = write_output(output_file, input, argc, im, out);
 
-      free_image(&out);
-      free_image(&im);
+      release_output(&out);
+      release_input(&im);
       fclose(output_file);
       
       return chk;
@@ -269,9 +713,9 @@ int handle_blur(char* input[], int argc, Image im) {
 
 int handle_pointilism(char* input[], int argc, Image im) {
   //checks for right number of arguments
-      if (argc != 4) {
+      if (argc != 4 && argc != 5) {
         fprintf(stderr, "Incorrect number of arguments for the specified operation");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_INVALID_OP_ARGS;
       }
     
@@ -279,16 +723,26 @@ int handle_pointilism(char* input[], int argc, Image im) {
       FILE *output_file = fopen(input[2], "w");    
       if (output_file == NULL) {
         fprintf(stderr, "Output file I/O error\n");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_WRITE_FAILED;
       }   
 
-      //preform edit
-      Image out = pointilism(im);
-      int chk = write_ppm(output_file, out);
+      //preform edit; the seed makes the result repeatable (1 is rand()'s default)
+      srand(pointilism_seed(input, argc));
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && pointilism_into(job_ctx, im, out) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
 
-      free_image(&im);
-      free_image(&out);
+      release_input(&im);
+      release_output(&out);
       fclose(output_file);
       
       return chk;
@@ -298,7 +752,7 @@ int handle_saturate(char* input[], int argc, Image im) {
   //checks for right number of arguments
       if (argc != 5) {
         fprintf(stderr, "Incorrect number of arguments for the specified operation");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_INVALID_OP_ARGS;
       }
 
@@ -306,27 +760,1076 @@ int handle_saturate(char* input[], int argc, Image im) {
       FILE *output_file = fopen(input[2], "w");
       if (output_file == NULL) {
         fprintf(stderr, "Output file I/O error\n");
-	      free_image(&im);
+	      release_input(&im);
 	      return RC_WRITE_FAILED;
       }
 
       //checks if parameter is in bounds
       double scale = strtod(input[4], NULL);
-      if (scale < 0) {
+      if (scale < 0 || scale > COLOR_MATRIX_MAX) {
         fprintf(stderr, "Parameter not in bounds\n");
-	      free_image(&im);
+	      release_input(&im);
 	      fclose(output_file);
 	      return RC_OP_ARGS_RANGE_ERR;
       }
 
       //preform edit
-      Image out = saturate(im, scale);
-      int chk = write_ppm(output_file, out);
+      Image out = inplace_output(im);
+      if (out.data != NULL && saturate_into(job_ctx, im, out, scale) != IM_OK) {
+        release_inplace_output(&out, im);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
 
-      free_image(&out);
-      free_image(&im);
+      release_inplace_output(&out, im);
+      release_input(&im);
       fclose(output_file);
       
       return chk;
 }
 
+
+int handle_stats(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 4) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //opens report file, "-" means stdout (the client's reply under --serve)
+      int to_stdout = strcmp(input[2], "-") == 0;
+      FILE *output_file = !to_stdout ? fopen(input[2], "w") : job_reply != NULL ? job_reply : stdout;
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      ImageStats st;
+      if (image_stats_into(job_ctx, im, &st) != IM_OK) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        if (!to_stdout) {
+          fclose(output_file);
+        }
+        return RC_UNSPECIFIED_ERR;
+      }
+
+      const char *names[STAT_CHANNELS] = { "red", "green", "blue", "luma" };
+      fprintf(output_file, "pixels %llu\n", st.count);
+      fprintf(output_file, "%-6s %4s %4s %8s %4s %4s %4s %4s %4s\n",
+              "chan", "min", "max", "mean", "p1", "p5", "p50", "p95", "p99");
+      for (int c = 0; c < STAT_CHANNELS; c++) {
+        fprintf(output_file, "%-6s %4d %4d %8.3f %4d %4d %4d %4d %4d\n",
+                names[c], st.min[c], st.max[c], st.mean[c],
+                stats_percentile(&st, c, 1), stats_percentile(&st, c, 5),
+                stats_percentile(&st, c, 50), stats_percentile(&st, c, 95),
+                stats_percentile(&st, c, 99));
+      }
+
+      int chk = ferror(output_file) ? RC_WRITE_FAILED : RC_SUCCESS;
+
+      release_input(&im);
+      if (!to_stdout) {
+        fclose(output_file);
+      }
+
+      return chk;
+}
+
+int handle_auto_levels(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 4 && argc != 6) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //checks if parameters are in bounds
+      double low = 0.5;
+      double high = 99.5;
+      if (argc == 6) {
+        low = strtod(input[4], NULL);
+        high = strtod(input[5], NULL);
+      }
+      if (low < 0 || high > 100 || low >= high) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      fclose(output_file);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && auto_levels_into(job_ctx, im, out, low, high) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_convolve(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 5) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      Kernel k = load_kernel_arg(input[4]);
+      if (k.weights == NULL) {
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+        free_kernel(&k);
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && convolve_into(job_ctx, im, out, &k) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        free_kernel(&k);
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      free_kernel(&k);
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_rotate_angle(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are valid
+      char *end;
+      double degrees = strtod(input[4], &end);
+      int bilinear = parse_sampling(input, argc, 5);
+      if (end == input[4] || bilinear < 0) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && rotate_into(job_ctx, im, out, degrees, bilinear) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_affine(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are valid
+      double m[6];
+      int bilinear = parse_sampling(input, argc, 5);
+      if (parse_matrix(input[4], m) != 0 || bilinear < 0) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && affine_into(job_ctx, im, out, m, bilinear) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Matrix is not invertible or memory allocation failed\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_OP_ARGS_RANGE_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_color_matrix(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 5) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are valid
+      double m[12];
+      if (parse_color_matrix(input[4], m) != 0) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = inplace_output(im);
+      if (out.data != NULL && color_matrix_into(job_ctx, im, out, m) != IM_OK) {
+        release_inplace_output(&out, im);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_inplace_output(&out, im);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+
+int handle_crop(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 8) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //x, y, width and height must be whole numbers
+      int rect[4];
+      for (int i = 0; i < 4; i++) {
+        if (parse_ints(input[4 + i], &rect[i], 1) != 0) {
+          fprintf(stderr, "crop expects whole numbers for x, y, width and height\n");
+          release_input(&im);
+          return RC_INVALID_OP_ARGS;
+        }
+      }
+
+      //checks if parameters are valid; the output is a view, nothing is copied
+      Image out = image_view(im, rect[0], rect[1], rect[2], rect[3]);
+      if (out.data == NULL) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_median(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 5) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameter is in bounds
+      int radius = atoi(input[4]);
+      if (radius < 1 || radius > MEDIAN_MAX_RADIUS) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && median_into(job_ctx, im, out, radius) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_unsharp(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 7) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are in bounds
+      double sigma = strtod(input[4], NULL);
+      double amount = strtod(input[5], NULL);
+      int threshold = atoi(input[6]);
+      if (sigma < 0.1 || sigma > BLUR_MAX_SIGMA || amount < 0 || threshold < 0 || threshold > 255) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && unsharp_into(job_ctx, im, out, sigma, amount, threshold) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+int handle_bilateral(char* input[], int argc, Image im) {
+  //checks for right number of arguments
+      if (argc != 6) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are in bounds
+      double sigma_s = strtod(input[4], NULL);
+      double sigma_r = strtod(input[5], NULL);
+      if (!(sigma_s >= 1) || !(sigma_r >= 1)) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      int status = out.data != NULL ? bilateral_into(job_ctx, im, out, sigma_s, sigma_r) : IM_OK;
+      if (status == IM_ERR_ARGS) {
+        fprintf(stderr, "Bilateral grid too large: raise sigma_s or sigma_r\n");
+        release_output(&out);
+        release_input(&im);
+        fclose(output_file);
+        return RC_OP_ARGS_RANGE_ERR;
+      }
+      if (status != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+/*
+the MorphOp of a morphology command, or -1 for any other command
+*/
+/*
+how far (x, y) the command reads around each output pixel, so --roi can
+give it the real neighbours of the region and its result matches a
+full-image run inside the region
+*/
+void roi_margin(char* input[], int argc, int margin[2]) {
+  const char *cmd = input[3];
+  double reach = 0;
+  margin[0] = margin[1] = 0;
+
+  if ((strcmp(cmd, "blur") == 0 || strcmp(cmd, "unsharp") == 0) && argc > 4) {
+    //the Gaussian is ten sigma wide
+    reach = 5 * strtod(input[4], NULL);
+  } else if (strcmp(cmd, "median") == 0 && argc > 4) {
+    reach = strtod(input[4], NULL);
+  } else if (strcmp(cmd, "bilateral") == 0 && argc > 4) {
+    //a splatted cell, the grid blur's two cells and the interpolation
+    reach = 4 * strtod(input[4], NULL);
+  } else if (strcmp(cmd, "convolve") == 0 && argc > 4) {
+    Kernel k = kernel_preset(input[4]);
+    reach = k.weights != NULL ? k.size / 2 : KERNEL_MAX_SIZE / 2;
+    free_kernel(&k);
+  } else if (morph_op(cmd) >= 0 && argc > 4) {
+    //open and close run two steps
+    int steps = morph_op(cmd) == MORPH_OPEN || morph_op(cmd) == MORPH_CLOSE ? 2 : 1;
+    double width = strtod(input[4], NULL);
+    double height = argc > 5 ? strtod(input[5], NULL) : width;
+    margin[0] = width > 0 && width <= MORPH_MAX_SIZE ? steps * ((int)width / 2) : 0;
+    margin[1] = height > 0 && height <= MORPH_MAX_SIZE ? steps * ((int)height / 2) : 0;
+    return;
+  }
+
+  //rounded up; out of range arguments are rejected by the handler, so
+  //only keep the margin sane
+  if (reach > 0) {
+    margin[0] = margin[1] = reach < 1 << 20 ? (int)reach + 1 : 1 << 20;
+  }
+}
+
+int morph_op(const char* cmd) {
+  if (strcmp(cmd, "erode") == 0) {
+    return MORPH_ERODE;
+  } else if (strcmp(cmd, "dilate") == 0) {
+    return MORPH_DILATE;
+  } else if (strcmp(cmd, "open") == 0) {
+    return MORPH_OPEN;
+  } else if (strcmp(cmd, "close") == 0) {
+    return MORPH_CLOSE;
+  }
+  return -1;
+}
+
+int handle_morph(char* input[], int argc, Image im, MorphOp op) {
+  //checks for right number of arguments
+      if (argc != 5 && argc != 6) {
+        fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+	      release_input(&im);
+	      return RC_INVALID_OP_ARGS;
+      }
+
+      //checks if parameters are in bounds
+      int width = atoi(input[4]);
+      int height = argc == 6 ? atoi(input[5]) : width;
+      if (width < 1 || height < 1 || width > MORPH_MAX_SIZE || height > MORPH_MAX_SIZE) {
+        fprintf(stderr, "Parameter not in bounds\n");
+	      release_input(&im);
+	      return RC_OP_ARGS_RANGE_ERR;
+      }
+
+      //allocates output image
+      FILE *output_file = fopen(input[2], "w");
+      if (output_file == NULL) {
+        fprintf(stderr, "Output file I/O error\n");
+	      release_input(&im);
+	      return RC_WRITE_FAILED;
+      }
+
+      //preform edit
+      Image out = output_image(im.rows, im.cols);
+      if (out.data != NULL && morph_into(job_ctx, im, out, op, width, height) != IM_OK) {
+        release_output(&out);
+      }
+      if(out.data == NULL) {
+        fprintf(stderr, "Failed to allocate memory\n");
+        release_input(&im);
+        fclose(output_file);
+        return RC_UNSPECIFIED_ERR;
+      }
+      int chk = write_output(output_file, input, argc, im, out);
+
+      release_output(&out);
+      release_input(&im);
+      fclose(output_file);
+
+      return chk;
+}
+
+/*
+input image i of a stack: the usual input image, then the arguments after the mode
+*/
+static const char* stack_path(char* input[], int i) {
+  return i == 0 ? input[1] : input[4 + i];
+}
+
+int handle_stack(char* input[], int argc) {
+  //checks for right number of arguments
+  if (argc < 5 || argc - 4 > STACK_MAX_IMAGES) {
+    fprintf(stderr, "Incorrect number of arguments for the specified operation\n");
+    return RC_INVALID_OP_ARGS;
+  }
+  if (roi_active || read_scale != 1) {
+    fprintf(stderr, "--roi and --downscale are not supported for stack\n");
+    return RC_INVALID_OP_ARGS;
+  }
+
+  //checks if parameter is valid
+  StackMode mode;
+  if (strcmp(input[4], "mean") == 0) {
+    mode = STACK_MEAN;
+  } else if (strcmp(input[4], "median") == 0) {
+    mode = STACK_MEDIAN;
+  } else if (strcmp(input[4], "max") == 0) {
+    mode = STACK_MAX;
+  } else if (strcmp(input[4], "min") == 0) {
+    mode = STACK_MIN;
+  } else {
+    fprintf(stderr, "Parameter not in bounds\n");
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+
+  //every input stays open, plus the output and standard streams
+  int n = argc - 4;
+  struct rlimit files_limit;
+  if (getrlimit(RLIMIT_NOFILE, &files_limit) == 0 && files_limit.rlim_cur != RLIM_INFINITY
+      && (rlim_t)n + STACK_SPARE_FILES > files_limit.rlim_cur) {
+    fprintf(stderr, "stack of %d images needs more open files than the limit of %llu\n",
+            n, (unsigned long long)files_limit.rlim_cur);
+    return RC_OP_ARGS_RANGE_ERR;
+  }
+  FILE **files = calloc(n, sizeof(FILE *));
+  Image *slices = calloc(n, sizeof(Image));
+  Pixel *buffer = NULL;
+  Image out = { NULL, 0, 0, 0 };
+  FILE *output_file = NULL;
+  int rows = 0, cols = 0;
+  int rc = RC_SUCCESS;
+  if (files == NULL || slices == NULL) {
+    fprintf(stderr, "Failed to allocate memory\n");
+    rc = RC_UNSPECIFIED_ERR;
+  }
+
+  //open every input and check that the sizes agree
+  for (int i = 0; i < n && rc == RC_SUCCESS; i++) {
+    int r, c;
+    files[i] = fopen(stack_path(input, i), "r");
+    if (files[i] == NULL) {
+      fprintf(stderr, "Failed to open input file %s\n", stack_path(input, i));
+      rc = RC_OPEN_FAILED;
+    } else if (read_ppm_header(files[i], &r, &c) != 0) {
+      rc = RC_INVALID_PPM;
+    } else if (i == 0) {
+      rows = r;
+      cols = c;
+    } else if (r != rows || c != cols) {
+      fprintf(stderr, "Stacked images must all have the same size\n");
+      rc = RC_OP_ARGS_RANGE_ERR;
+    }
+  }
+
+  //a slice per input, and one for the output, with a band for every thread
+  int slice_rows = STACK_ROWS * context_threads(job_ctx);
+  size_t slice_row_bytes = sizeof(Pixel) * (size_t)cols * n;
+  if (slice_row_bytes > 0 && (size_t)slice_rows > STACK_SLICE_BYTES / slice_row_bytes) {
+    slice_rows = (int)(STACK_SLICE_BYTES / slice_row_bytes);
+    if (slice_rows < STACK_ROWS) {
+      slice_rows = STACK_ROWS;
+    }
+  }
+  if (slice_rows > rows) {
+    slice_rows = rows;
+  }
+  if (rc == RC_SUCCESS) {
+    buffer = malloc(slice_row_bytes * slice_rows);
+    out = make_image(slice_rows, cols);
+    if (buffer == NULL || out.data == NULL) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      rc = RC_UNSPECIFIED_ERR;
+    }
+  }
+  if (rc == RC_SUCCESS) {
+    output_file = fopen(input[2], "w");
+    if (output_file == NULL) {
+      fprintf(stderr, "Output file I/O error\n");
+      rc = RC_WRITE_FAILED;
+    } else {
+      rc = write_ppm_header(output_file, rows, cols);
+    }
+  }
+
+  for (int y = 0; y < rows && rc == RC_SUCCESS; y += slice_rows) {
+    int h = rows - y < slice_rows ? rows - y : slice_rows;
+    for (int i = 0; i < n && rc == RC_SUCCESS; i++) {
+      Image slice = { buffer + (size_t)slice_rows * cols * i, h, cols, cols };
+      slices[i] = slice;
+      if (read_ppm_rows(files[i], slice) != 0) {
+        rc = RC_INVALID_PPM;
+      }
+    }
+    if (rc != RC_SUCCESS) {
+      break;
+    }
+
+    Image out_slice = image_view(out, 0, 0, cols, h);
+    if (stack_into(job_ctx, slices, n, out_slice, mode) != IM_OK) {
+      fprintf(stderr, "Failed to allocate memory\n");
+      rc = RC_UNSPECIFIED_ERR;
+    } else {
+      rc = write_ppm_rows(output_file, out_slice);
+    }
+  }
+
+  for (int i = 0; files != NULL && i < n; i++) {
+    if (files[i] != NULL) {
+      fclose(files[i]);
+    }
+  }
+  if (output_file != NULL) {
+    fclose(output_file);
+  }
+  free(files);
+  free(slices);
+  free(buffer);
+  free_image(&out);
+
+  if (rc == RC_SUCCESS && verify_mode) {
+    rc = verify_stack(input, argc, mode);
+  }
+  return rc;
+}
+
+/*
+loads every stacked image and the written result, and compares the
+result with the reference stack
+*/
+int verify_stack(char* input[], int argc, StackMode mode) {
+  int n = argc - 4;
+  Image *ins = calloc(n, sizeof(Image));
+  Image out = { NULL, 0, 0, 0 };
+  Image ref = { NULL, 0, 0, 0 };
+  int ok = ins != NULL;
+
+  for (int i = 0; ok && i < n; i++) {
+    FILE *fp = fopen(stack_path(input, i), "r");
+    ok = fp != NULL;
+    if (ok) {
+      ins[i] = read_ppm(fp);
+      fclose(fp);
+      ok = ins[i].data != NULL;
+    }
+  }
+  if (ok) {
+    FILE *fp = fopen(input[2], "r");
+    if (fp != NULL) {
+      out = read_ppm(fp);
+      fclose(fp);
+    }
+    ref = stack_ref(ins, n, mode);
+  }
+
+  int rc = RC_VERIFY_FAILED;
+  ImageDiff diff;
+  if (out.data == NULL || ref.data == NULL) {
+    fprintf(stderr, "verify: reference stack failed\n");
+  } else if (compare_images(out, ref, 0, &diff) != 0) {
+    fprintf(stderr, "verify stack: dimensions differ\n");
+  } else {
+    printf("verify stack %dx%d: max deviation %d, mismatched pixels %zu of %zu\n",
+           out.cols, out.rows, diff.max_delta, diff.mismatched, (size_t)out.rows * out.cols);
+    rc = diff.mismatched > 0 ? RC_VERIFY_FAILED : RC_SUCCESS;
+  }
+
+  for (int i = 0; ins != NULL && i < n; i++) {
+    free_image(&ins[i]);
+  }
+  free(ins);
+  free_image(&out);
+  free_image(&ref);
+  return rc;
+}
+
+/*
+optional seed argument of pointilism, 1 if not given
+*/
+unsigned int pointilism_seed(char* input[], int argc) {
+  return argc > 4 ? (unsigned int)strtoul(input[4], NULL, 10) : 1;
+}
+
+/*
+optional sampling argument at input[index]: returns 1 for bilinear
+(the default), 0 for nearest, -1 for anything else
+*/
+int parse_sampling(char* input[], int argc, int index) {
+  if (argc <= index || strcmp(input[index], "bilinear") == 0) {
+    return 1;
+  }
+  if (strcmp(input[index], "nearest") == 0) {
+    return 0;
+  }
+  return -1;
+}
+
+/*
+parses six comma separated numbers; returns 0 on success
+*/
+int parse_matrix(const char* arg, double m[6]) {
+  return parse_doubles(arg, m, 6);
+}
+
+/*
+parses n comma separated numbers; returns 0 on success
+*/
+int parse_doubles(const char* arg, double *vals, int n) {
+  const char *p = arg;
+  for (int i = 0; i < n; i++) {
+    char *end;
+    vals[i] = strtod(p, &end);
+    if (end == p || (i < n - 1 && *end != ',') || (i == n - 1 && *end != '\0')) {
+      return -1;
+    }
+    p = end + 1;
+  }
+  return 0;
+}
+
+/*
+a color matrix preset or twelve numbers, checked against the limits
+of color_matrix(); returns 0 on success
+*/
+int parse_color_matrix(const char* arg, double m[12]) {
+  if (color_matrix_preset(arg, m) == 0) {
+    return 0;
+  }
+  if (parse_doubles(arg, m, 12) != 0) {
+    return -1;
+  }
+  for (int i = 0; i < 12; i++) {
+    double limit = i % 4 == 3 ? COLOR_MATRIX_MAX_OFFSET : COLOR_MATRIX_MAX;
+    if (!(m[i] >= -limit && m[i] <= limit)) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/*
+parses n comma separated integers; returns 0 on success
+*/
+int parse_ints(const char* arg, int *vals, int n) {
+  const char *p = arg;
+  for (int i = 0; i < n; i++) {
+    char *end;
+    long v = strtol(p, &end, 10);
+    if (end == p || (i < n - 1 && *end != ',') || (i == n - 1 && *end != '\0')
+        || v < INT_MIN || v > INT_MAX) {
+      return -1;
+    }
+    vals[i] = (int)v;
+    p = end + 1;
+  }
+  return 0;
+}
+
+/*
+reads an input image at the --downscale size
+*/
+Image read_input(FILE *fp) {
+  return read_ppm_scaled(fp, read_scale, read_mode);
+}
+
+/*
+checks the image read with --downscale against the reference
+shrink of the full-size image
+*/
+int verify_downscale(const char* path, Image im) {
+  FILE *fp = fopen(path, "r");
+  Image full = { NULL, 0, 0, 0 };
+  if (fp != NULL) {
+    full = read_ppm(fp);
+    fclose(fp);
+  }
+  Image ref = downscale_ref(full, read_scale, read_mode);
+  free_image(&full);
+  if (ref.data == NULL) {
+    fprintf(stderr, "verify: reference downscale failed\n");
+    return RC_VERIFY_FAILED;
+  }
+
+  ImageDiff diff;
+  int rc = RC_SUCCESS;
+  if (compare_images(im, ref, 0, &diff) != 0 || diff.mismatched > 0) {
+    fprintf(stderr, "verify: --downscale %d read differs from the reference\n", read_scale);
+    rc = RC_VERIFY_FAILED;
+  }
+  free_image(&ref);
+  return rc;
+}
+
+/*
+the output file of a job; blend takes its second input first
+*/
+const char* output_path(char* input[]) {
+  return strcmp(input[3], "blend") == 0 ? input[4] : input[2];
+}
+
+/*
+whether argument i of a job names a file the job reads: blend's second
+image or convolve's kernel file (the input image itself counts by its
+pixels)
+*/
+static int file_operand(char* input[], int i) {
+  return (strcmp(input[3], "blend") == 0 && i == 2)
+      || (strcmp(input[3], "convolve") == 0 && i == 4);
+}
+
+/*
+cache key of a job: the input pixels, the options that change the
+result, and every argument but the output path as text. The files a
+job reads (see file_operand) also count by content.
+*/
+unsigned long long job_key(char* input[], int argc, Image im) {
+  unsigned long long h = hash64("image_manip result", 18, 0);
+  int opts[9] = { im.rows, im.cols, read_scale, (int)read_mode, roi_active,
+                  roi_rect[0], roi_rect[1], roi_rect[2], roi_rect[3] };
+  if (!roi_active) {
+    memset(opts + 5, 0, sizeof(int) * 4);
+  }
+  h = hash64(opts, sizeof(opts), h);
+
+  for (int y = 0; y < im.rows; y++) {
+    h = hash64(image_row(im, y), sizeof(Pixel) * im.cols, h);
+  }
+
+  const char *out = output_path(input);
+  for (int i = 2; i < argc; i++) {
+    if (input[i] == out) {
+      continue;
+    }
+    h = hash64(input[i], strlen(input[i]) + 1, h);
+    if (file_operand(input, i)) {
+      h = hash64_file(input[i], h);
+    }
+  }
+  return h;
+}
+
+/*
+adds the job to the cache counters and reports the totals
+*/
+void report_cache(int hit, int evicted) {
+  CacheCounters c = cache_count(cache_dir, hit, !hit, evicted);
+  fprintf(stderr, "cache %s: %llu hits, %llu misses, %llu evictions\n",
+          hit ? "hit" : "miss", c.hits, c.misses, c.evictions);
+}
+
+/*
+resolves a convolve argument: a named preset first, otherwise a kernel file
+*/
+Kernel load_kernel_arg(const char* arg) {
+  Kernel k = kernel_preset(arg);
+  if (k.weights != NULL) {
+    return k;
+  }
+
+  FILE *kernel_file = fopen(arg, "r");
+  if (kernel_file == NULL) {
+    fprintf(stderr, "Unknown kernel preset or unreadable kernel file\n");
+    return k;
+  }
+  k = read_kernel(kernel_file);
+  fclose(kernel_file);
+  return k;
+}
+
+/*
+runs the reference implementation of the current command on the
+same input and compares it with the optimized result
+*/
+int verify_result(char* input[], int argc, Image im, Image out) {
+  Image ref = { NULL, 0, 0, 0 };
+  const char *cmd = input[3];
+
+  if (strcmp(cmd, "grayscale") == 0) {
+    ref = grayscale_ref(im);
+  } else if (strcmp(cmd, "blend") == 0) {
+    FILE *second_image = fopen(input[2], "r");
+    if (second_image != NULL) {
+      Image im2 = read_input(second_image);
+      fclose(second_image);
+      if (im2.data != NULL) {
+        ref = blend_ref(im, im2, strtod(input[5], NULL));
+        free_image(&im2);
+      }
+    }
+  } else if (strcmp(cmd, "rotate-ccw") == 0) {
+    ref = rotate_ccw_ref(im);
+  } else if (strcmp(cmd, "pointilism") == 0) {
+    //same random sequence as the optimized run
+    srand(pointilism_seed(input, argc));
+    ref = pointilism_ref(im);
+  } else if (strcmp(cmd, "blur") == 0) {
+    ref = blur_ref(im, strtod(input[4], NULL));
+  } else if (morph_op(cmd) >= 0) {
+    int width = atoi(input[4]);
+    ref = morph_ref(im, (MorphOp)morph_op(cmd), width, argc == 6 ? atoi(input[5]) : width);
+  } else if (strcmp(cmd, "unsharp") == 0) {
+    ref = unsharp_ref(im, strtod(input[4], NULL), strtod(input[5], NULL), atoi(input[6]));
+  } else if (strcmp(cmd, "bilateral") == 0) {
+    ref = bilateral_ref(im, strtod(input[4], NULL), strtod(input[5], NULL));
+  } else if (strcmp(cmd, "median") == 0) {
+    ref = median_ref(im, atoi(input[4]));
+  } else if (strcmp(cmd, "saturate") == 0) {
+    ref = saturate_ref(im, strtod(input[4], NULL));
+  } else if (strcmp(cmd, "color-matrix") == 0) {
+    double m[12];
+    parse_color_matrix(input[4], m);
+    ref = color_matrix_ref(im, m);
+  } else if (strcmp(cmd, "auto-levels") == 0) {
+    double low = argc == 6 ? strtod(input[4], NULL) : 0.5;
+    double high = argc == 6 ? strtod(input[5], NULL) : 99.5;
+    ref = auto_levels_ref(im, low, high);
+  } else if (strcmp(cmd, "convolve") == 0) {
+    Kernel k = load_kernel_arg(input[4]);
+    if (k.weights != NULL) {
+      ref = convolve_ref(im, &k);
+      free_kernel(&k);
+    }
+  } else if (strcmp(cmd, "rotate") == 0) {
+    double m[6];
+    rotation_matrix(im.rows, im.cols, im.rows, im.cols, strtod(input[4], NULL), m);
+    ref = affine_ref(im, m, parse_sampling(input, argc, 5));
+  } else if (strcmp(cmd, "affine") == 0) {
+    double m[6];
+    parse_matrix(input[4], m);
+    ref = affine_ref(im, m, parse_sampling(input, argc, 5));
+  } else {
+    fprintf(stderr, "verify: no reference implementation for %s\n", cmd);
+    return RC_SUCCESS;
+  }
+
+  if (ref.data == NULL) {
+    fprintf(stderr, "verify: reference %s failed\n", cmd);
+    return RC_VERIFY_FAILED;
+  }
+
+  //exact match expected, so any difference counts
+  ImageDiff diff;
+  int rc = RC_SUCCESS;
+  if (compare_images(out, ref, 0, &diff) != 0) {
+    fprintf(stderr, "verify %s: dimensions differ (%dx%d vs reference %dx%d)\n",
+            cmd, out.cols, out.rows, ref.cols, ref.rows);
+    rc = RC_VERIFY_FAILED;
+  } else {
+    printf("verify %s %dx%d: max deviation %d, mismatched pixels %zu of %zu\n",
+           cmd, out.cols, out.rows, diff.max_delta, diff.mismatched, (size_t)out.rows * out.cols);
+    if (diff.mismatched > 0) {
+      rc = RC_VERIFY_FAILED;
+    }
+  }
+
+  free_image(&ref);
+  return rc;
+}
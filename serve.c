@@ -0,0 +1,208 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <ctype.h>
+#include <errno.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include "serve.h"
+
+#define MAX_JOB_ARGS 64
+#define MAX_LINE 4096
+
+static volatile sig_atomic_t stop_requested = 0;
+
+static void on_stop_signal(int sig) {
+  (void)sig;
+  stop_requested = 1;
+}
+
+typedef struct {
+  int jobs;
+  int failed;
+  double total_ms;
+  double max_ms;
+} ServeStats;
+
+static double now_ms(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1e6;
+}
+
+/*
+splits a line in place on whitespace; argv[0] is a placeholder so the
+job sees the same layout as main()
+*/
+static int split_line(char *line, char *argv[]) {
+  static char prog[] = "project";
+  int argc = 0;
+  argv[argc++] = prog;
+
+  char *p = line;
+  while (*p != '\0' && argc < MAX_JOB_ARGS) {
+    while (isspace((unsigned char)*p)) {
+      *p++ = '\0';
+    }
+    if (*p == '\0') {
+      break;
+    }
+    argv[argc++] = p;
+    while (*p != '\0' && !isspace((unsigned char)*p)) {
+      p++;
+    }
+  }
+  argv[argc] = NULL;
+  return argc;
+}
+
+/*
+answers jobs from one stream until it ends; returns 1 if "quit" was read
+*/
+static int serve_stream(FILE *in, FILE *out, job_fn run_job, ServeStats *st) {
+  char line[MAX_LINE];
+  char *argv[MAX_JOB_ARGS + 1];
+
+  while (!stop_requested && fgets(line, sizeof(line), in) != NULL) {
+    int argc = split_line(line, argv);
+    if (argc == 1 || argv[1][0] == '#') {
+      continue;
+    }
+    if (argc == 2 && strcmp(argv[1], "quit") == 0) {
+      return 1;
+    }
+
+    double start = now_ms();
+    int rc = run_job(argc, argv, out);
+    double elapsed = now_ms() - start;
+
+    st->jobs++;
+    st->failed += rc != 0;
+    st->total_ms += elapsed;
+    if (elapsed > st->max_ms) {
+      st->max_ms = elapsed;
+    }
+
+    fflush(stdout);
+    fprintf(out, "%d %.3f\n", rc, elapsed);
+    fflush(out);
+  }
+  return 0;
+}
+
+static int serve_socket(const char *path, job_fn run_job, ServeStats *st) {
+  struct sockaddr_un addr;
+  if (strlen(path) >= sizeof(addr.sun_path)) {
+    fprintf(stderr, "Error:serve - socket path too long\n");
+    return 1;
+  }
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  strcpy(addr.sun_path, path);
+
+  int listen_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if (listen_fd < 0) {
+    perror("Error:serve - socket");
+    return 1;
+  }
+  //replace a stale socket from an earlier run, but never anything else
+  struct stat st_path;
+  if (lstat(path, &st_path) == 0) {
+    if (!S_ISSOCK(st_path.st_mode)) {
+      fprintf(stderr, "Error:serve - %s exists and is not a socket\n", path);
+      close(listen_fd);
+      return 1;
+    }
+    unlink(path);
+  }
+  if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) != 0 || listen(listen_fd, 16) != 0) {
+    perror("Error:serve - bind");
+    close(listen_fd);
+    return 1;
+  }
+  fprintf(stderr, "serving on %s\n", path);
+
+  //one client at a time; each job still fans out over the thread pool
+  int quit = 0;
+  while (!quit && !stop_requested) {
+    int fd = accept(listen_fd, NULL, NULL);
+    if (fd < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      perror("Error:serve - accept");
+      break;
+    }
+
+    FILE *in = fdopen(fd, "r");
+    int out_fd = dup(fd);
+    FILE *out = out_fd >= 0 ? fdopen(out_fd, "w") : NULL;
+    if (in == NULL || out == NULL) {
+      perror("Error:serve - fdopen");
+      if (in != NULL) {
+        fclose(in);
+      } else {
+        close(fd);
+      }
+      if (out_fd >= 0 && out == NULL) {
+        close(out_fd);
+      }
+      continue;
+    }
+
+    quit = serve_stream(in, out, run_job, st);
+    fclose(out);
+    fclose(in);
+  }
+
+  close(listen_fd);
+  unlink(path);
+  return 0;
+}
+
+int serve(const char *path, job_fn run_job) {
+  ServeStats st = { 0, 0, 0.0, 0.0 };
+
+  //let blocking reads and accept() return so the loop can stop
+  struct sigaction sa;
+  memset(&sa, 0, sizeof(sa));
+  sa.sa_handler = on_stop_signal;
+  sigemptyset(&sa.sa_mask);
+  sigaction(SIGINT, &sa, NULL);
+  sigaction(SIGTERM, &sa, NULL);
+
+  //a client hanging up must not kill the server
+  signal(SIGPIPE, SIG_IGN);
+
+  int rc;
+  if (strcmp(path, "-") == 0) {
+    //stdout carries only the replies; whatever the jobs print goes to stderr
+    fflush(stdout);
+    int reply_fd = dup(STDOUT_FILENO);
+    FILE *replies = reply_fd >= 0 ? fdopen(reply_fd, "w") : NULL;
+    if (replies == NULL || dup2(STDERR_FILENO, STDOUT_FILENO) < 0) {
+      perror("Error:serve - stdout");
+      if (replies != NULL) {
+        fclose(replies);
+      } else if (reply_fd >= 0) {
+        close(reply_fd);
+      }
+      return 1;
+    }
+    serve_stream(stdin, replies, run_job, &st);
+    fclose(replies);
+    rc = 0;
+  } else {
+    rc = serve_socket(path, run_job, &st);
+  }
+
+  fprintf(stderr, "served %d jobs (%d failed), mean %.3f ms, max %.3f ms\n",
+          st.jobs, st.failed, st.jobs ? st.total_ms / st.jobs : 0.0, st.max_ms);
+  return rc;
+}
@@ -0,0 +1,25 @@
+#ifndef SERVE_H
+#define SERVE_H
+
+#include <stdio.h>
+
+/* runs one job; gets the same argument vector main() would for a
+ * single invocation (argv[0] is a placeholder) and returns its exit code.
+ * Text the job would print to stdout as its result (stats with "-" as
+ * the output) goes to reply instead, which reaches the client */
+typedef int (*job_fn)( int argc , char * argv[] , FILE * reply );
+
+/* long-running job loop. Jobs arrive one per line as the usual
+ * command-line arguments separated by whitespace, e.g.
+ *   in.ppm out.ppm blur 2.5
+ * and each is answered with a line "<exit code> <latency in ms>",
+ * preceded by any text the job sends to its reply stream.
+ * path is a UNIX domain socket to listen on (an existing file there is
+ * only replaced if it is a socket), or "-" to read jobs from stdin and
+ * answer on stdout; in that mode anything else the jobs print to stdout
+ * is sent to stderr instead, so stdout holds nothing but replies. A line
+ * "quit", SIGINT or SIGTERM stops the loop. Returns 0 on a clean
+ * shutdown. */
+int serve( const char * path , job_fn run_job );
+
+#endif
@@ -0,0 +1,230 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <pthread.h>
+#include "thread_pool.h"
+#include "trace.h"
+
+struct ThreadPool {
+  pthread_t *threads;
+  int nworkers;            // worker threads, not counting the caller
+
+  pthread_mutex_t lock;
+  pthread_cond_t work_cv;  // signalled when a new batch is posted
+  pthread_cond_t done_cv;  // signalled when the last task of a batch ends
+
+  pool_task_fn fn;
+  void *ctx;
+  int n_tasks;
+  int next_task;
+  int unfinished;
+  unsigned long batch;     // bumped every time a batch is posted
+  int running;             // a batch is currently in flight
+  int shutdown;
+};
+
+/*
+grabs task indices from the current batch until none are left.
+Called with the lock held; returns with the lock held. Workers pass
+idle_since to have the time between their tasks traced as idle.
+*/
+static void drain_tasks(ThreadPool *pool, unsigned long long *idle_since) {
+  while (pool->next_task < pool->n_tasks) {
+    int task = pool->next_task++;
+    pthread_mutex_unlock(&pool->lock);
+    if (idle_since != NULL) {
+      trace_span("pool", "idle", *idle_since, -1);
+    }
+    pool->fn(pool->ctx, task);
+    pthread_mutex_lock(&pool->lock);
+    if (--pool->unfinished == 0) {
+      pthread_cond_broadcast(&pool->done_cv);
+    }
+    if (idle_since != NULL) {
+      *idle_since = trace_now();
+    }
+  }
+}
+
+static void *worker_main(void *arg) {
+  ThreadPool *pool = arg;
+  unsigned long seen = 0;
+  unsigned long long idle_since = 0;
+
+  pthread_mutex_lock(&pool->lock);
+  idle_since = trace_now();
+  for (;;) {
+    while (!pool->shutdown && pool->batch == seen) {
+      pthread_cond_wait(&pool->work_cv, &pool->lock);
+    }
+    if (pool->shutdown) {
+      break;
+    }
+    seen = pool->batch;
+    drain_tasks(pool, &idle_since);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return NULL;
+}
+
+static int default_thread_count(void) {
+  const char *env = getenv("IMAGE_MANIP_THREADS");
+  if (env != NULL && atoi(env) > 0) {
+    return atoi(env);
+  }
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  return ncpu > 0 ? (int)ncpu : 1;
+}
+
+ThreadPool *pool_create(int nthreads) {
+  if (nthreads <= 0) {
+    nthreads = default_thread_count();
+  }
+
+  ThreadPool *pool = calloc(1, sizeof(ThreadPool));
+  if (pool == NULL) {
+    return NULL;
+  }
+  pthread_mutex_init(&pool->lock, NULL);
+  pthread_cond_init(&pool->work_cv, NULL);
+  pthread_cond_init(&pool->done_cv, NULL);
+
+  pool->threads = malloc(sizeof(pthread_t) * nthreads);
+  if (pool->threads == NULL) {
+    pool_destroy(pool);
+    return NULL;
+  }
+
+  //the caller always takes part, so spawn one fewer worker
+  for (int i = 0; i < nthreads - 1; i++) {
+    if (pthread_create(&pool->threads[i], NULL, worker_main, pool) != 0) {
+      fprintf(stderr, "Warning: thread_pool - only started %d of %d threads\n", i + 1, nthreads);
+      break;
+    }
+    pool->nworkers++;
+  }
+  return pool;
+}
+
+void pool_destroy(ThreadPool *pool) {
+  if (pool == NULL) {
+    return;
+  }
+  pthread_mutex_lock(&pool->lock);
+  pool->shutdown = 1;
+  pthread_cond_broadcast(&pool->work_cv);
+  pthread_mutex_unlock(&pool->lock);
+
+  for (int i = 0; i < pool->nworkers; i++) {
+    pthread_join(pool->threads[i], NULL);
+  }
+  free(pool->threads);
+  pthread_cond_destroy(&pool->done_cv);
+  pthread_cond_destroy(&pool->work_cv);
+  pthread_mutex_destroy(&pool->lock);
+  free(pool);
+}
+
+int pool_size(const ThreadPool *pool) {
+  return pool == NULL ? 1 : pool->nworkers + 1;
+}
+
+void pool_run(ThreadPool *pool, int n_tasks, pool_task_fn fn, void *ctx) {
+  if (n_tasks <= 0) {
+    return;
+  }
+
+  //no workers, a single task, or a nested call: just run inline
+  int inline_run = (pool == NULL || pool->nworkers == 0 || n_tasks == 1);
+  if (!inline_run) {
+    pthread_mutex_lock(&pool->lock);
+    inline_run = pool->running;
+    if (!inline_run) {
+      pool->running = 1;
+      pool->fn = fn;
+      pool->ctx = ctx;
+      pool->n_tasks = n_tasks;
+      pool->next_task = 0;
+      pool->unfinished = n_tasks;
+      pool->batch++;
+      pthread_cond_broadcast(&pool->work_cv);
+    } else {
+      pthread_mutex_unlock(&pool->lock);
+    }
+  }
+
+  if (inline_run) {
+    for (int i = 0; i < n_tasks; i++) {
+      fn(ctx, i);
+    }
+    return;
+  }
+
+  //help out, then wait for the stragglers
+  drain_tasks(pool, NULL);
+  unsigned long long wait_start = pool->unfinished > 0 ? trace_now() : 0;
+  while (pool->unfinished > 0) {
+    pthread_cond_wait(&pool->done_cv, &pool->lock);
+  }
+  trace_span("pool", "wait", wait_start, -1);
+  pool->running = 0;
+  pthread_mutex_unlock(&pool->lock);
+}
+
+static ThreadPool *the_default_pool = NULL;
+static pthread_once_t default_once = PTHREAD_ONCE_INIT;
+
+static void destroy_default_pool(void) {
+  pool_destroy(the_default_pool);
+  the_default_pool = NULL;
+}
+
+static void create_default_pool(void) {
+  the_default_pool = pool_create(0);
+  atexit(destroy_default_pool);
+}
+
+ThreadPool *default_pool(void) {
+  pthread_once(&default_once, create_default_pool);
+  return the_default_pool;
+}
+
+int pool_band_count(const ThreadPool *pool, int rows) {
+  int n = pool_size(pool);
+  if (n > rows) {
+    n = rows;
+  }
+  return n < 1 ? 1 : n;
+}
+
+typedef struct {
+  band_fn fn;
+  void *ctx;
+  int rows;
+  int bands;
+} BandJob;
+
+static void band_task(void *arg, int band) {
+  BandJob *job = arg;
+  //spread the remainder so band sizes differ by at most one row
+  int begin = (int)((long long)job->rows * band / job->bands);
+  int end = (int)((long long)job->rows * (band + 1) / job->bands);
+  unsigned long long t0 = trace_now();
+  job->fn(job->ctx, band, begin, end);
+  trace_span("pool", "band", t0, band);
+}
+
+void pool_rows(ThreadPool *pool, int rows, band_fn fn, void *ctx) {
+  BandJob job = { fn, ctx, rows, pool_band_count(pool, rows) };
+  pool_run(pool, job.bands, band_task, &job);
+}
+
+int band_count(int rows) {
+  return pool_band_count(default_pool(), rows);
+}
+
+void parallel_rows(int rows, band_fn fn, void *ctx) {
+  pool_rows(default_pool(), rows, fn, ctx);
+}
@@ -0,0 +1,51 @@
+#ifndef THREAD_POOL_H
+#define THREAD_POOL_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* task callback: called once for every task index in [0, n_tasks) */
+typedef void (*pool_task_fn)( void *ctx , int task );
+
+/* callback for parallel_rows: process rows [begin, end) of band number band */
+typedef void (*band_fn)( void *ctx , int band , int begin , int end );
+
+/* opaque pool of persistent worker threads */
+typedef struct ThreadPool ThreadPool;
+
+/* create a pool that runs tasks on nthreads threads (the calling
+ * thread counts as one of them); nthreads <= 0 picks one per online CPU,
+ * or the value of the IMAGE_MANIP_THREADS environment variable if set */
+ThreadPool * pool_create( int nthreads );
+
+/* stop and join all workers, then free the pool (NULL is ignored) */
+void pool_destroy( ThreadPool * pool );
+
+/* number of threads that execute tasks, including the caller */
+int pool_size( const ThreadPool * pool );
+
+/* run fn(ctx, i) for every i in [0, n_tasks) and wait for all of them;
+ * a call made from inside a running task executes serially */
+void pool_run( ThreadPool * pool , int n_tasks , pool_task_fn fn , void *ctx );
+
+/* process-wide pool, created on first use */
+ThreadPool * default_pool( void );
+
+/* number of bands pool_rows splits rows into (one per thread,
+ * never more than rows); callers size per-band scratch with this */
+int pool_band_count( const ThreadPool * pool , int rows );
+
+/* split rows [0, rows) into pool_band_count(pool, rows) contiguous
+ * bands and process them on the given pool */
+void pool_rows( ThreadPool * pool , int rows , band_fn fn , void *ctx );
+
+/* pool_band_count and pool_rows on the default pool */
+int band_count( int rows );
+void parallel_rows( int rows , band_fn fn , void *ctx );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
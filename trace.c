@@ -0,0 +1,180 @@
+#define _POSIX_C_SOURCE 200809L
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <pthread.h>
+#include "trace.h"
+
+/* spans kept per thread; a power of two so the ring index is a mask */
+#define TRACE_RING_SIZE (1 << 15)
+
+typedef struct {
+  const char *cat;
+  const char *name;
+  unsigned long long start;
+  unsigned long long end;
+  long long arg;
+} TraceEvent;
+
+typedef struct TraceRing {
+  TraceEvent events[TRACE_RING_SIZE];
+  unsigned long long written;  // total spans recorded; the ring holds the last ones
+  int tid;
+  struct TraceRing *next;
+} TraceRing;
+
+// set by trace_start and trace_write, read by every recording thread; a
+// pool may already be running (--serve), so they go through atomics (the
+// GCC builtins, as the tree is C99): trace_on is stored with release
+// after trace_epoch and loaded with acquire before it
+static int trace_on = 0;
+static unsigned long long trace_epoch = 0;
+
+static int tracing(void) {
+  return __atomic_load_n(&trace_on, __ATOMIC_ACQUIRE);
+}
+
+// every thread's ring, so trace_write can find them
+static pthread_mutex_t rings_lock = PTHREAD_MUTEX_INITIALIZER;
+static TraceRing *rings = NULL;
+static int ring_count = 0;
+
+static pthread_key_t ring_key;
+static pthread_once_t ring_key_once = PTHREAD_ONCE_INIT;
+
+static void free_rings(void) {
+  while (rings != NULL) {
+    TraceRing *next = rings->next;
+    free(rings);
+    rings = next;
+  }
+}
+
+static void create_ring_key(void) {
+  pthread_key_create(&ring_key, NULL);
+  atexit(free_rings);
+}
+
+/*
+the calling thread's ring, created and registered on first use;
+NULL if it could not be allocated
+*/
+static TraceRing *thread_ring(void) {
+  pthread_once(&ring_key_once, create_ring_key);
+  TraceRing *ring = pthread_getspecific(ring_key);
+  if (ring != NULL) {
+    return ring;
+  }
+
+  ring = calloc(1, sizeof(TraceRing));
+  if (ring == NULL) {
+    return NULL;
+  }
+  pthread_mutex_lock(&rings_lock);
+  ring->tid = ring_count++;
+  ring->next = rings;
+  rings = ring;
+  pthread_mutex_unlock(&rings_lock);
+  pthread_setspecific(ring_key, ring);
+  return ring;
+}
+
+static unsigned long long clock_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + (unsigned long long)ts.tv_nsec;
+}
+
+void trace_start(void) {
+  TraceRing *self = thread_ring();
+
+  //renumber so the starting thread is tid 0 and the rest follow
+  pthread_mutex_lock(&rings_lock);
+  int tid = 1;
+  for (TraceRing *r = rings; r != NULL; r = r->next) {
+    r->written = 0;
+    r->tid = (r == self) ? 0 : tid++;
+  }
+  ring_count = tid;
+  pthread_mutex_unlock(&rings_lock);
+
+  __atomic_store_n(&trace_epoch, clock_ns(), __ATOMIC_RELAXED);
+  __atomic_store_n(&trace_on, 1, __ATOMIC_RELEASE);
+}
+
+unsigned long long trace_now(void) {
+  return tracing() ? clock_ns() : 0;
+}
+
+void trace_span(const char *cat, const char *name, unsigned long long start, long long arg) {
+  if (!tracing() || start == 0) {
+    return;
+  }
+  unsigned long long end = clock_ns();
+  TraceRing *ring = thread_ring();
+  if (ring == NULL) {
+    return;
+  }
+
+  TraceEvent *ev = &ring->events[ring->written & (TRACE_RING_SIZE - 1)];
+  ev->cat = cat;
+  ev->name = name;
+  ev->start = start;
+  ev->end = end;
+  ev->arg = arg;
+  ring->written++;
+}
+
+/* microseconds since trace_start, clamped to the start of the trace */
+static double trace_us(unsigned long long t) {
+  unsigned long long epoch = __atomic_load_n(&trace_epoch, __ATOMIC_RELAXED);
+  return t > epoch ? (t - epoch) / 1000.0 : 0.0;
+}
+
+int trace_write(const char *path) {
+  __atomic_store_n(&trace_on, 0, __ATOMIC_RELEASE);
+
+  FILE *fp = fopen(path, "w");
+  if (fp == NULL) {
+    fprintf(stderr, "Error:trace - could not open %s\n", path);
+    return -1;
+  }
+
+  fprintf(fp, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+  int first = 1;
+
+  pthread_mutex_lock(&rings_lock);
+  for (TraceRing *r = rings; r != NULL; r = r->next) {
+    if (r->tid == 0) {
+      fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}",
+              first ? "" : ",\n");
+    } else {
+      fprintf(fp, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"worker %d\"}}",
+              first ? "" : ",\n", r->tid, r->tid);
+    }
+    first = 0;
+
+    //oldest surviving span first
+    unsigned long long begin = r->written > TRACE_RING_SIZE ? r->written - TRACE_RING_SIZE : 0;
+    for (unsigned long long i = begin; i < r->written; i++) {
+      const TraceEvent *ev = &r->events[i & (TRACE_RING_SIZE - 1)];
+      double ts = trace_us(ev->start);
+      fprintf(fp, ",\n{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+              ev->name, ev->cat, r->tid, ts, trace_us(ev->end) - ts);
+      if (ev->arg >= 0) {
+        fprintf(fp, ",\"args\":{\"index\":%lld}", ev->arg);
+      }
+      fputc('}', fp);
+    }
+  }
+  pthread_mutex_unlock(&rings_lock);
+
+  fprintf(fp, "\n]}\n");
+  int rc = ferror(fp) ? -1 : 0;
+  if (fclose(fp) != 0 || rc != 0) {
+    fprintf(stderr, "Error:trace - failed writing %s\n", path);
+    return -1;
+  }
+  return 0;
+}
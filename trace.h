@@ -0,0 +1,42 @@
+#ifndef TRACE_H
+#define TRACE_H
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Timeline tracing in the Chrome trace event format (chrome://tracing,
+ * ui.perfetto.dev). Every thread records complete spans into its own
+ * ring buffer, so recording takes no locks; when a ring is full the
+ * oldest spans are overwritten. While tracing is off, trace_now
+ * returns 0 and trace_span returns right away.
+ *
+ * Typical use:
+ *   unsigned long long t0 = trace_now();
+ *   ... work ...
+ *   trace_span("kernel", "blur", t0, -1);
+ */
+
+/* clear all rings and start recording; the calling thread is shown
+ * as "main" and every other thread as "worker <n>" */
+void trace_start( void );
+
+/* stop recording and write everything recorded since trace_start to
+ * path as JSON; returns 0 on success, -1 if the file can't be written.
+ * Must not run while other threads are still recording. */
+int trace_write( const char * path );
+
+/* monotonic timestamp in nanoseconds, or 0 if tracing is off */
+unsigned long long trace_now( void );
+
+/* record a span from start (a trace_now value) until now on the calling
+ * thread. cat and name must outlive the trace (string literals); arg is
+ * shown as the span's "index" unless it is negative. Ignored if tracing
+ * is off or start is 0. */
+void trace_span( const char * cat , const char * name , unsigned long long start , long long arg );
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif